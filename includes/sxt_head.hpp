@@ -56,9 +56,18 @@
 #   define SXT_SIZE_T std::size_t
 #endif // !defined SXT_SIZE_T
 
-#define SXT__NEXT_CHAR_WITHOUT_LINECHECK(it__, charcol__) ++(charcol__); ++(it__); 
+#if (!(defined SXT_OFFSET_T))
+#   include <cstdint>
+#   define SXT_OFFSET_T std::uint32_t
+#endif // !defined SXT_OFFSET_T
+
+#include <vector>
+#include <algorithm>
+
+// track__ is a compile time constant, offset tokens do no line and column work per char
+#define SXT__NEXT_CHAR_WITHOUT_LINECHECK(track__, it__, charcol__) if (track__) { ++(charcol__); } ++(it__); 
 //do { ++(charcol__); ++(it__); } while(0) // but.. a bit slower. 
-#define SXT__NEXT_CHAR_V(it__, itvalue__, charln__, charcol__) if (itvalue__ == '\n') { charcol__ = 0ULL; ++(charln__); } else { ++(charcol__); }  ++(it__);
+#define SXT__NEXT_CHAR_V(track__, it__, itvalue__, charln__, charcol__) if (track__) { if (itvalue__ == '\n') { charcol__ = 0ULL; ++(charln__); } else { ++(charcol__); } }  ++(it__);
 //do { if (char_traits_type::eq(itvalue__, '\n')) { charcol__ = 0ULL; ++(charln__); } else { ++(charcol__); }  ++(it__); } while(0) // but.. a bit slower.
 
 namespace sxt {
@@ -248,6 +257,74 @@ namespace sxt {
             return column_;
         }
     };
+
+    /**
+     * @brief A token that carries only the byte offset of its first char, see line_index to get its line and column.
+     */
+    template<class StringT_>
+    struct offset_token : public value_token<StringT_> {
+        private:
+        SXT_OFFSET_T offset_;
+
+        public:
+        offset_token() : value_token<StringT_>(), offset_(0u) {
+
+        }
+        offset_token(value_token<StringT_>&& value, SXT_OFFSET_T offset) : value_token<StringT_>(SXT_MOVE(value)), offset_(offset) {
+
+        }
+
+        public:
+        [[nodiscard]] SXT_OFFSET_T offset() const noexcept {
+            return offset_;
+        }
+    };
+
+    /**
+     * @brief Offsets of the line starts of an input string, resolves offsets to the line and column that position_token would have.
+     *
+     * @tparam StringT_ type of string to use.
+     */
+    template<class StringT_>
+    struct line_index {
+        public:
+        typedef typename StringT_::value_type char_type;
+        typedef SXT_DEFAULT_CHAR_TRAITS<char_type> char_traits_type;
+
+        private:
+        std::vector<SXT_OFFSET_T> lineStarts_; /// Offset of the first char of every line, the first line starts at 0.
+
+        public:
+        line_index() : lineStarts_(1u, 0u) {
+
+        }
+        /**
+         * @brief Builds the index with one scan for newlines (memchr for char strings).
+         *
+         * @param str the string the offsets refer to.
+         */
+        explicit line_index(const StringT_& str) : lineStarts_(1u, 0u) {
+            const char_type* const begin = str.data();
+            const char_type* const end = begin + str.size();
+            for (const char_type* it = begin; it != end; ++it) {
+                it = char_traits_type::find(it, static_cast<SXT_SIZE_T>(end - it), char_type('\n'));
+                if (it == nullptr)
+                    break;
+                lineStarts_.push_back(static_cast<SXT_OFFSET_T>(it - begin + 1));
+            }
+        }
+
+        public:
+        [[nodiscard]] SXT_SIZE_T line(SXT_OFFSET_T offset) const noexcept {
+            return static_cast<SXT_SIZE_T>(std::upper_bound(lineStarts_.begin(), lineStarts_.end(), offset) - lineStarts_.begin()) - 1u;
+        }
+        [[nodiscard]] SXT_SIZE_T column(SXT_OFFSET_T offset) const noexcept {
+            return static_cast<SXT_SIZE_T>(offset - lineStarts_[line(offset)]);
+        }
+        [[nodiscard]] SXT_SIZE_T line_count() const noexcept {
+            return lineStarts_.size();
+        }
+    };
     /**
      * @brief A tokenizer class that can be configured to split input strings into tokens based on customizable delimiters and traits.
      *
@@ -260,6 +337,7 @@ namespace sxt {
         typedef typename StringT_::const_iterator const_iterator;
         typedef value_token<StringT_> value_token_type;
         typedef position_token<StringT_> position_token_type;
+        typedef offset_token<StringT_> offset_token_type;
         typedef typename StringT_::value_type char_type;
         typedef TokenSymbolsTraitsT_ symbols_trait_type;
 
@@ -284,31 +362,27 @@ namespace sxt {
 
         }
 
-        public:
-        /**
-         * @brief Retrieves the next token from the input range.
-         *
-         * @param flags the flags for token type.
-         * @return The next token of type value_token_type.
-         */
-        value_token_type next_new_token(ext_token_type_flag_bits flags) {
+        private:
+        template<bool TrackPositionV_>
+        value_token_type next_token_(ext_token_type_flag_bits flags) {
             const auto createNumberToken = [](const_iterator& currentr, SXT_SIZE_T& columnr, const_iterator end__, const_iterator b) {
                 token_type numberType = STX_TOKEN_TYPE_INTEGER;
                 
                 for (char_type currentValue = *currentr; currentr != end__;  currentValue = *currentr) {
                     token_type curType = symbols_trait_type::type_from_char(currentValue);
                     if ((numberType == STX_TOKEN_TYPE_INTEGER) && (curType == token_type::STX_TOKEN_TYPE_DOT)) {
-                        SXT__NEXT_CHAR_WITHOUT_LINECHECK(currentr, columnr);
+                        SXT__NEXT_CHAR_WITHOUT_LINECHECK(TrackPositionV_, currentr, columnr);
                         if ((currentr == end__) || (symbols_trait_type::type_from_char(*currentr) != token_type::STX_TOKEN_TYPE_INTEGER)) {
                             --currentr;
-                            --columnr;
+                            if (TrackPositionV_)
+                                --columnr;
                             break;
                         }
                         numberType = STX_TOKEN_TYPE_FLOAT;
                     } else if (curType != token_type::STX_TOKEN_TYPE_INTEGER) {
                         break;
                     }
-                    SXT__NEXT_CHAR_WITHOUT_LINECHECK(currentr, columnr);
+                    SXT__NEXT_CHAR_WITHOUT_LINECHECK(TrackPositionV_, currentr, columnr);
                 }
                 
                 return value_token_type(numberType, StringT_(b, currentr));
@@ -320,7 +394,7 @@ namespace sxt {
             while (current_ != end_) {
                 auto currentValue = *current_;
                 if (SXT_ISSAPCE(currentValue)) {
-                    SXT__NEXT_CHAR_V(current_, currentValue, line_, column_);
+                    SXT__NEXT_CHAR_V(TrackPositionV_, current_, currentValue, line_, column_);
                     continue;
                 }
                 const token_type currentTokenType = symbols_trait_type::type_from_char(currentValue);
@@ -331,14 +405,14 @@ namespace sxt {
                         currentValue = *current_;
                         if (!isWordSymbol(currentValue))
                             break;
-                        SXT__NEXT_CHAR_WITHOUT_LINECHECK(current_, column_);
+                        SXT__NEXT_CHAR_WITHOUT_LINECHECK(TrackPositionV_, current_, column_);
                     }
                     return value_token_type(STX_TOKEN_TYPE_WORD, StringT_(wordStart, current_));
                     
                 } else if (currentTokenType == STX_TOKEN_TYPE_INTEGER) {
                     return createNumberToken(current_, column_, end_, current_);
                 }  else if (currentTokenType == token_type::STX_TOKEN_TYPE_MINUS) {
-                    SXT__NEXT_CHAR_WITHOUT_LINECHECK(current_, column_);
+                    SXT__NEXT_CHAR_WITHOUT_LINECHECK(TrackPositionV_, current_, column_);
                     if (flags & STX_EXT_TOKEN_TYPE_FLAG_BIT_SIGNED_NUMBERS) {
                         if ((current_ != end_) && (symbols_trait_type::type_from_char(*current_) == token_type::STX_TOKEN_TYPE_INTEGER))
                             return createNumberToken(current_, column_, end_, current_ - 1);
@@ -347,7 +421,7 @@ namespace sxt {
                 } else if (currentTokenType == STX_TOKEN_TYPE_DOUBLE_QUOTE) {
                     if (flags & STX_EXT_TOKEN_TYPE_FLAG_BIT_STRING_LETTERAL) {
                         const auto wordStart = current_;
-                        SXT__NEXT_CHAR_WITHOUT_LINECHECK(current_, column_);
+                        SXT__NEXT_CHAR_WITHOUT_LINECHECK(TrackPositionV_, current_, column_);
                         bool slash = false;
                         while (current_ != end_) {
                             currentValue = *current_;
@@ -358,48 +432,79 @@ namespace sxt {
                                 if (tokenType == STX_TOKEN_TYPE_BACKCLASH) {
                                     slash = true;
                                 } else if (tokenType == STX_TOKEN_TYPE_DOUBLE_QUOTE) {
-                                    SXT__NEXT_CHAR_WITHOUT_LINECHECK(current_, column_);
+                                    SXT__NEXT_CHAR_WITHOUT_LINECHECK(TrackPositionV_, current_, column_);
                                     return value_token_type(STX_TOKEN_TYPE_STRING_LETTERAL, StringT_(wordStart, current_));
                                 }
                             }
-                            SXT__NEXT_CHAR_V(current_, currentValue, line_, column_);
+                            SXT__NEXT_CHAR_V(TrackPositionV_, current_, currentValue, line_, column_);
                         }
                     } else {
-                        SXT__NEXT_CHAR_WITHOUT_LINECHECK(current_, column_);
+                        SXT__NEXT_CHAR_WITHOUT_LINECHECK(TrackPositionV_, current_, column_);
                         return value_token_type(STX_TOKEN_TYPE_DOUBLE_QUOTE, StringT_(current_ - 1, current_));
                     }
 
                 } else if (!this_type_is_valid(currentTokenType)) {
                     if (flags & STX_EXT_TOKEN_TYPE_FLAG_BIT_UNKNOWN_AS_WORDS) {
-                        SXT__NEXT_CHAR_WITHOUT_LINECHECK(current_, column_);
+                        SXT__NEXT_CHAR_WITHOUT_LINECHECK(TrackPositionV_, current_, column_);
                         return value_token_type(STX_TOKEN_TYPE_WORD, StringT_(current_ - 1, current_));
                     } else {
                         SXT_ASSERT(false); // unknown symbol
                         return value_token_type();
                     }
                 } else {
-                    SXT__NEXT_CHAR_WITHOUT_LINECHECK(current_, column_);
+                    SXT__NEXT_CHAR_WITHOUT_LINECHECK(TrackPositionV_, current_, column_);
                     return value_token_type(currentTokenType,  StringT_(current_ - 1, current_));
                 }
             }
             return value_token_type();
         }
+
+        public:
         /**
-         * @brief Retrieves the next token with information about position from the input range.
+         * @brief Retrieves the next token from the input range.
          *
          * @param flags the flags for token type.
          * @return The next token of type value_token_type.
          */
+        value_token_type next_new_token(ext_token_type_flag_bits flags) {
+            return next_token_<true>(flags);
+        }
+        /**
+         * @brief Retrieves the next token with information about position from the input range.
+         *
+         * @param flags the flags for token type.
+         * @return The next token of type value_token_type, with the line and column of its first char.
+         */
         position_token_type next_position_token(ext_token_type_flag_bits flags) {
             while (current_ != end_) {
                 auto currentValue = *current_;
                 if (!SXT_ISSAPCE(currentValue)) {
-                    return position_token_type(next_new_token(flags), line_, column_);
+                    const SXT_SIZE_T line = line_;
+                    const SXT_SIZE_T column = column_;
+                    return position_token_type(next_new_token(flags), line, column);
                 }
-                SXT__NEXT_CHAR_V(current_, currentValue, line_, column_);
+                SXT__NEXT_CHAR_V(true, current_, currentValue, line_, column_);
             }
             return position_token_type();
         }
+        /**
+         * @brief Retrieves the next token with the offset of its first char from the beginning of the input range.
+         * Doesn't track lines and columns, line() and column() of the tokenizer don't move, use line_index for the tokens.
+         *
+         * @param flags the flags for token type.
+         * @return The next token of type offset_token_type.
+         */
+        offset_token_type next_offset_token(ext_token_type_flag_bits flags) {
+            while (current_ != end_) {
+                if (!SXT_ISSAPCE(*current_)) {
+                    SXT_ASSERT(static_cast<SXT_SIZE_T>(current_ - begin_) <= static_cast<SXT_SIZE_T>(static_cast<SXT_OFFSET_T>(-1)));
+                    const SXT_OFFSET_T offset = static_cast<SXT_OFFSET_T>(current_ - begin_);
+                    return offset_token_type(next_token_<false>(flags), offset);
+                }
+                ++current_;
+            }
+            return offset_token_type();
+        }
         [[nodiscard]] SXT_SIZE_T line() const noexcept {
             return line_;
         }
@@ -27,7 +27,18 @@
 #include <string>
 #include <vector>
 #include <algorithm>
+#include <cstdint>
+#include <cctype>
+#include <fstream>
+#include <sstream>
+#include <map>
+#include <chrono>
+#include <cstdio>
 #include <sxt_head.hpp>
+#ifdef __linux__
+#include <sys/inotify.h>
+#include <unistd.h>
+#endif
 
 using std::string;
 using std::vector;
@@ -46,13 +57,21 @@ IterT find_pred(IterT begin, const IterT end, const FindT& value, PredT pred) {
 
 enum definition_type {
     DEFINITION_TYPE_STRUCT,         // opcode [ NAME ]
-    DEFINITION_TYPE_COMPONENT,      // opcode [ NAME COMPONENT_ID ]
-    DEFINITION_TYPE_MEMBER,         // opcode [ TYPENAME NAME ]
+    DEFINITION_TYPE_COMPONENT,      // opcode [ NAME COMPONENT_ID ] or [ NAME COMPONENT_ID "buffered" ]
+    DEFINITION_TYPE_TAG_COMPONENT,  // opcode [ NAME TAG_ID ]
+    DEFINITION_TYPE_EVENT,          // opcode [ NAME ]
+    DEFINITION_TYPE_GROUP,          // opcode [ COMPONENTS... ]
+    DEFINITION_TYPE_MEMBER,         // opcode [ TYPENAME NAME ] or [ TYPENAME NAME "indexed" ]
     DEFINITION_TYPE_FUNCTION,       // opcode [ RETURN_TYPENAME NAME ARGS... ]
     DEFINITION_TYPE_CREATE,         // opcode [ NAME ]
     DEFINITION_TYPE_ADD_COMPONENTS, // opcode [ NAME COMPONENTS... ]
     DEFINITION_TYPE_DESTROY_ENTITY, // opcode [ NAME ]
-    DEFINITION_TYPE_FOREACH_CYCLE,  // opcode [ ITERATOR_NAME COMPONENTS... ]
+    DEFINITION_TYPE_DESTROY_ALL,    // opcode [ COMPONENTS... ]
+    DEFINITION_TYPE_FOREACH_CYCLE,  // opcode [ ITERATOR_NAME COMPONENTS... ], "!name" excludes a component, "?name" is optional
+    DEFINITION_TYPE_FOREACH_HIERARCHY, // opcode [ ITERATOR_NAME COMPONENTS... ], same filters
+    DEFINITION_TYPE_FOREACH_EVENT,  // opcode [ ITERATOR_NAME EVENT_NAME ]
+    DEFINITION_TYPE_BINDING,        // opcode [ COMPONENT NAME ] or [ COMPONENT NAME "optional" ], follows its foreach
+    DEFINITION_TYPE_SET_PARENT,     // opcode [ CHILD_NAME PARENT_NAME ]
     DEFINITION_TYPE_BODY_BEGIN,     // opcode [ ]
     DEFINITION_TYPE_BODY_END,       // opcode [ ]
     DEFINITION_TYPE_EOF,
@@ -61,12 +80,20 @@ const char* definition_type_to_string(definition_type deft) {
     switch (deft) {
         case DEFINITION_TYPE_STRUCT: return         "STRUCT";
         case DEFINITION_TYPE_COMPONENT: return      "COMPONENT";
+        case DEFINITION_TYPE_TAG_COMPONENT: return  "TAG_COMPONENT";
+        case DEFINITION_TYPE_EVENT: return          "EVENT";
+        case DEFINITION_TYPE_GROUP: return          "GROUP";
         case DEFINITION_TYPE_MEMBER: return         "MEMBER";
         case DEFINITION_TYPE_FUNCTION: return       "FUNCTION";
         case DEFINITION_TYPE_CREATE: return         "CREATE";
         case DEFINITION_TYPE_ADD_COMPONENTS: return "ADD_COMPONENTS";
         case DEFINITION_TYPE_DESTROY_ENTITY: return "DESTROY_ENTITY";
+        case DEFINITION_TYPE_DESTROY_ALL: return    "DESTROY_ALL";
         case DEFINITION_TYPE_FOREACH_CYCLE: return  "FOREACH";
+        case DEFINITION_TYPE_FOREACH_HIERARCHY: return "FOREACH_HIERARCHY";
+        case DEFINITION_TYPE_FOREACH_EVENT: return  "FOREACH_EVENT";
+        case DEFINITION_TYPE_BINDING: return        "BINDING";
+        case DEFINITION_TYPE_SET_PARENT: return     "SET_PARENT";
         case DEFINITION_TYPE_BODY_BEGIN: return     "BODY_BEGIN";
         case DEFINITION_TYPE_BODY_END: return       "BODY_END";
         case DEFINITION_TYPE_EOF: return            "PROGRAM_END";
@@ -74,6 +101,16 @@ const char* definition_type_to_string(definition_type deft) {
     }
 }
 
+// spelling of the statements that open a body, for comments and profiler scope names
+const char* definition_type_to_keyword(definition_type deft) {
+    switch (deft) {
+        case DEFINITION_TYPE_FOREACH_CYCLE: return      "foreach";
+        case DEFINITION_TYPE_FOREACH_HIERARCHY: return  "foreach_hierarchy";
+        case DEFINITION_TYPE_FOREACH_EVENT: return      "foreach_event";
+        default: return "";
+    }
+}
+
 struct definition_info {
     definition_type type;
     vector<string> opcode;
@@ -82,12 +119,173 @@ struct variable_info {
     string typeName;
     string name;
 };
+struct generator_options {
+    bool profile; // instrument generated functions and foreach blocks
+    string benchDirectory; // write a benchmark program for the schema there, if not empty
+    string outputPath; // write the generated code there instead of stdout, if not empty
+    bool watch; // regenerate outputPath every time the schema is saved
+    bool shm; // component storage inside the world, so it can live in a shared memory object
+    string headerPath; // with sourcePath: split the generated code into a header and a source file
+    string sourcePath;
+    bool hints; // branch prediction and hot function hints on the accessors
+    bool pgoInstrument; // count component reads and foreach matches, see pgo_dump()
+    string pgoProfilePath; // profile written by pgo_dump(), it decides component ids and groups
+};
+
+// --watch reports a broken schema and waits for the next save instead of ending the process
+bool recoverableErrors = false;
+size_t errorLineOffset = 0u; // lines of the schema above the chunk being parsed
+const string* errorSource = nullptr; // text being parsed, tokens only keep their offset into it
+struct schema_error {};
+[[noreturn]] void fail() {
+    if (recoverableErrors)
+        throw schema_error();
+    exit(1);
+}
 
 #define ERROR_REPORT(msg__) do { \
-    cout << (to_string(ii->line()) + ":" + to_string(ii->column()) + ": " + (msg__)); \
-    exit(1); \
+    const sxt::line_index<string> lines(*errorSource); \
+    cout << (to_string(lines.line(ii->offset()) + errorLineOffset) + ":" + to_string(lines.column(ii->offset())) + ": " + (msg__)); \
+    fail(); \
 } while(false)
 
+// component or tag component with this name, nullptr if there is none
+const definition_info* find_component(const vector<definition_info>& definitions, const string& name) {
+    for (const auto& d : definitions) {
+        if (((d.type == DEFINITION_TYPE_COMPONENT) || (d.type == DEFINITION_TYPE_TAG_COMPONENT)) && (d.opcode.at(0) == name))
+            return &d;
+    }
+    return nullptr;
+}
+
+// tags live only as bits: tagMask[entity][id / 64] bit (id % 64)
+string generate_c_tag_word(const definition_info& tagDefinition, const string& entityName) {
+    const size_t tagID = std::stoul(tagDefinition.opcode.at(1));
+    return "tagMask[" + entityName + "][" + to_string(tagID / 64u) + "]";
+}
+
+string generate_c_tag_bit(const definition_info& tagDefinition) {
+    const size_t tagID = std::stoul(tagDefinition.opcode.at(1));
+    return "((uint64_t)1u << " + to_string(tagID % 64u) + ")";
+}
+
+// members that follow a struct, component or event definition
+vector<definition_info> members_of(const vector<definition_info>& definitions, const definition_info& owner) {
+    vector<definition_info> members;
+    for (size_t i = static_cast<size_t>(&owner - definitions.data()) + 1u; (i < definitions.size()) && (definitions[i].type == DEFINITION_TYPE_MEMBER); ++i)
+        members.emplace_back(definitions[i]);
+    return members;
+}
+
+// typed pointers declared by `foreach e (position* p, velocity* v)`
+vector<definition_info> bindings_of(const vector<definition_info>& definitions, const definition_info& foreachDefinition) {
+    vector<definition_info> bindings;
+    for (size_t i = static_cast<size_t>(&foreachDefinition - definitions.data()) + 1u; (i < definitions.size()) && (definitions[i].type == DEFINITION_TYPE_BINDING); ++i)
+        bindings.emplace_back(definitions[i]);
+    return bindings;
+}
+
+// foreach loops over components, the ones --pgo-instrument counts
+bool is_query(const definition_info& definition) {
+    return (definition.type == DEFINITION_TYPE_FOREACH_CYCLE) || (definition.type == DEFINITION_TYPE_FOREACH_HIERARCHY);
+}
+
+// position of the query among all queries of the schema
+size_t query_index(const vector<definition_info>& definitions, const definition_info& query) {
+    return static_cast<size_t>(std::count_if(definitions.data(), &query, is_query));
+}
+
+bool is_optional_binding(const definition_info& binding) {
+    return (binding.opcode.size() > 2) && (binding.opcode[2] == "optional");
+}
+
+bool is_buffered_component(const definition_info& component) {
+    return (component.type == DEFINITION_TYPE_COMPONENT) && (component.opcode.size() > 2) && (component.opcode[2] == "buffered");
+}
+
+bool is_indexed_member(const definition_info& member) {
+    return (member.type == DEFINITION_TYPE_MEMBER) && (member.opcode.size() > 2) && (member.opcode[2] == "indexed");
+}
+
+bool has_indexed_members(const vector<definition_info>& definitions) {
+    return std::any_of(definitions.begin(), definitions.end(), is_indexed_member);
+}
+
+// int, float and structs made only of them need no destructor call
+bool is_trivially_destructible(const vector<definition_info>& definitions, const string& typeName) {
+    if ((typeName == "float") || (typeName == "int"))
+        return true;
+    for (const auto& d : definitions) {
+        if (((d.type == DEFINITION_TYPE_STRUCT) || (d.type == DEFINITION_TYPE_COMPONENT)) && (d.opcode.at(0) == typeName)) {
+            for (const auto& member : members_of(definitions, d)) {
+                if (!is_trivially_destructible(definitions, member.opcode.at(0)))
+                    return false;
+            }
+            return true;
+        }
+    }
+    return false;
+}
+
+// words of componentMask (type COMPONENT) or tagMask (type TAG_COMPONENT) with the bits of the named components set
+vector<uint64_t> mask_words(const vector<definition_info>& definitions, const vector<string>& components, definition_type type) {
+    size_t count = 0u;
+    for (const auto& d : definitions)
+        count += (d.type == type) ? 1u : 0u;
+    vector<uint64_t> words((count + 63u) / 64u, 0u);
+    for (const auto& component : components) {
+        const definition_info* d = find_component(definitions, component);
+        if ((d != nullptr) && (d->type == type)) {
+            const size_t id = std::stoul(d->opcode.at(1));
+            words[id / 64u] |= (uint64_t)1u << (id % 64u);
+        }
+    }
+    return words;
+}
+
+string generate_c_mask_word(uint64_t word) {
+    std::ostringstream hex;
+    hex << "0x" << std::hex << word << "u";
+    return hex.str();
+}
+
+string generate_c_mask_initializer(const vector<uint64_t>& words) {
+    string result;
+    for (const auto& word : words)
+        result += (result.empty() ? string() : string(", ")) + generate_c_mask_word(word);
+    return "{ " + result + " }";
+}
+
+// prefixes every line of already generated code with indent
+string indent_lines(const string& code, const string& indent) {
+    string result;
+    size_t begin = 0u;
+    while (begin < code.size()) {
+        const size_t end = code.find('\n', begin);
+        const size_t next = (end == string::npos) ? code.size() : end + 1u;
+        result += indent + code.substr(begin, next - begin);
+        begin = next;
+    }
+    return result;
+}
+
+// position_velocity for `group position velocity;`
+string group_name(const definition_info& groupDefinition) {
+    string name;
+    for (const auto& component : groupDefinition.opcode)
+        name += (name.empty() ? string() : string("_")) + component;
+    return name;
+}
+
+// the group that owns the component, nullptr if there is none
+const definition_info* find_owning_group(const vector<definition_info>& definitions, const string& component) {
+    for (const auto& d : definitions) {
+        if ((d.type == DEFINITION_TYPE_GROUP) && (std::find(d.opcode.begin(), d.opcode.end(), component) != d.opcode.end()))
+            return &d;
+    }
+    return nullptr;
+}
+
 template<class Iter, class ElseT>
 Iter predict_next(Iter iter, sxt::token_type type, ElseT elseF) {
     ++iter;
@@ -96,99 +294,1144 @@ Iter predict_next(Iter iter, sxt::token_type type, ElseT elseF) {
     return iter;
 }
 
-string generate_c_start_code(const vector<definition_info>& definitions) {
+string generate_c_start_code(const vector<definition_info>& definitions, const generator_options& options) {
     size_t componentCount = 0;
+    size_t tagCount = 0;
     for (const auto& i : definitions) {
         if (i.type == DEFINITION_TYPE_COMPONENT)
             ++componentCount;
+        else if (i.type == DEFINITION_TYPE_TAG_COMPONENT)
+            ++tagCount;
     }
+    // posix clocks and files have to be requested before the first system header
+    const bool needsPosix = options.profile || !options.benchDirectory.empty() || options.shm;
     return
+    (needsPosix ? string("#ifndef _POSIX_C_SOURCE\n#define _POSIX_C_SOURCE 200809L\n#endif\n") : string()) +
     "#include <malloc.h>\n"
+    "#include <stdlib.h>\n"
+    "#include <stdint.h>\n"
+    "#include <stdatomic.h>\n"
+    "#include <string.h>\n"
+    + (options.shm ? string("#include <stddef.h>\n#include <sys/mman.h>\n#include <sys/stat.h>\n#include <fcntl.h>\n#include <unistd.h>\n") : string()) +
     "#define COMPONENT_COUNT " + to_string(componentCount) + "\n"
+    "#define TAG_COMPONENT_COUNT " + to_string(tagCount) + "\n"
+    "#define TAG_MASK_WORDS ((TAG_COMPONENT_COUNT + 63) / 64)\n"
+    "#define COMPONENT_MASK_WORDS ((COMPONENT_COUNT + 63) / 64)\n"
+    "#ifndef MAX_ENTITY_COUNT\n"
     "#define MAX_ENTITY_COUNT 1024\n"
+    "#endif\n"
+    "#define EVENT_QUEUE_CAPACITY 1024 // power of two\n"
+    "#define INDEX_CAPACITY (MAX_ENTITY_COUNT * 2) // slots of every member index, half of them stay empty\n"
     "typedef size_t entity_t;\n"
+    "#define NO_ENTITY ((entity_t)-1)\n"
+    "#ifndef ECS_MAX_THREADS\n"
+    "#define ECS_MAX_THREADS 64 // threads with an id cache, the ones started after them use the free list directly\n"
+    "#endif\n"
+    "#define ID_CACHE_SIZE 64\n"
+    "#define FREE_LIST_END 0xffffffffu\n"
+    "_Static_assert(MAX_ENTITY_COUNT < FREE_LIST_END, \"free list links are 32 bit\");\n"
+    + (options.hints ? string(
+    "#if defined(__GNUC__)\n"
+    "#define ECS_HOT __attribute__((hot))\n"
+    "#define ECS_UNLIKELY(x) __builtin_expect(!!(x), 0)\n"
+    "#else\n"
+    "#define ECS_HOT\n"
+    "#define ECS_UNLIKELY(x) (x)\n"
+    "#endif\n") : string()) +
+    "#if defined(_MSC_VER)\n"
+    "#include <intrin.h>\n"
+    "static int ctz64(uint64_t x) {\n"
+    "\tunsigned long i;\n"
+    "\t_BitScanForward64(&i, x);\n"
+    "\treturn (int)i;\n"
+    "}\n"
+    "#else\n"
+    "#define ctz64(x) __builtin_ctzll(x)\n"
+    "#endif\n"
     "typedef struct component_info {\n"
     "\tint exist;\n"
     "\tchar* data;\n"
+    "\tint borrowed; // data points into the arrays of a group, it is not owned by the slot\n"
     "\tsize_t dataSize;\n"
-    "} component_info;\n"
-    "static component_info componentsData[COMPONENT_COUNT][MAX_ENTITY_COUNT] = {};\n"
-    "static int existMask[MAX_ENTITY_COUNT] = {};\n"
-    "static entity_t max_id = 0;\n"
-    "static entity_t freeIDs[MAX_ENTITY_COUNT] = {};\n"
-    "static size_t freeIDCount = 0;\n";
+    "} component_info;\n";
+}
+
+// per-thread rings of timed scopes, dumped as chrome trace-event json (chrome://tracing, perfetto)
+string generate_c_profiler(const generator_options& options) {
+    if (!options.profile)
+        return "";
+    return
+    "#include <stdio.h>\n"
+    "#include <time.h>\n"
+    "#define PROFILER_RING_SIZE 4096 // power of two, records kept per thread\n"
+    "typedef struct profiler_record {\n"
+    "\tconst char* name;\n"
+    "\tuint64_t begin;\n"
+    "\tuint64_t end;\n"
+    "\tuint64_t visited;\n"
+    "\tuint64_t matched;\n"
+    "\tuint64_t structural;\n"
+    "} profiler_record;\n"
+    "typedef struct profiler_thread {\n"
+    "\tprofiler_record records[PROFILER_RING_SIZE];\n"
+    "\tsize_t head;\n"
+    "\tsize_t threadID;\n"
+    "\tstruct profiler_thread* next;\n"
+    "} profiler_thread;\n"
+    "typedef struct profiler_scope {\n"
+    "\tconst char* name;\n"
+    "\tuint64_t begin;\n"
+    "\tuint64_t visited;\n"
+    "\tuint64_t matched;\n"
+    "\tuint64_t structural;\n"
+    "} profiler_scope;\n"
+    "static _Atomic(profiler_thread*) profilerThreads = 0;\n"
+    "static _Atomic size_t profilerThreadCount = 0;\n"
+    "static _Thread_local profiler_thread* profilerCurrent = 0;\n"
+    "static _Thread_local uint64_t profilerVisited = 0;\n"
+    "static _Thread_local uint64_t profilerMatched = 0;\n"
+    "static _Thread_local uint64_t profilerStructural = 0;\n"
+    "\n"
+    "static uint64_t profiler_now() {\n"
+    "\tstruct timespec ts;\n"
+    "\tclock_gettime(CLOCK_MONOTONIC, &ts);\n"
+    "\treturn (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;\n"
+    "}\n"
+    "\n"
+    "// the ring of the calling thread, registered in profilerThreads on first use\n"
+    "static profiler_thread* profiler_thread_get() {\n"
+    "\tif (profilerCurrent == 0) {\n"
+    "\t\tprofiler_thread* thread = (profiler_thread*)calloc(1u, sizeof(profiler_thread));\n"
+    "\t\tthread->threadID = atomic_fetch_add(&profilerThreadCount, 1u);\n"
+    "\t\tthread->next = atomic_load(&profilerThreads);\n"
+    "\t\twhile (!atomic_compare_exchange_weak(&profilerThreads, &thread->next, thread)) {\n"
+    "\t\t}\n"
+    "\t\tprofilerCurrent = thread;\n"
+    "\t}\n"
+    "\treturn profilerCurrent;\n"
+    "}\n"
+    "\n"
+    "static profiler_scope profiler_begin(const char* name) {\n"
+    "\tprofiler_scope scope;\n"
+    "\tscope.name = name;\n"
+    "\tscope.visited = profilerVisited;\n"
+    "\tscope.matched = profilerMatched;\n"
+    "\tscope.structural = profilerStructural;\n"
+    "\tscope.begin = profiler_now();\n"
+    "\treturn scope;\n"
+    "}\n"
+    "\n"
+    "static void profiler_end(const profiler_scope* scope) {\n"
+    "\tconst uint64_t end = profiler_now();\n"
+    "\tprofiler_thread* thread = profiler_thread_get();\n"
+    "\tprofiler_record* record = &thread->records[thread->head & (PROFILER_RING_SIZE - 1u)];\n"
+    "\t++thread->head;\n"
+    "\trecord->name = scope->name;\n"
+    "\trecord->begin = scope->begin;\n"
+    "\trecord->end = end;\n"
+    "\trecord->visited = profilerVisited - scope->visited;\n"
+    "\trecord->matched = profilerMatched - scope->matched;\n"
+    "\trecord->structural = profilerStructural - scope->structural;\n"
+    "}\n"
+    "\n"
+    "// call while no other thread is inside a profiled scope, returns 0 on failure\n"
+    "int profiler_dump(const char* path) {\n"
+    "\tFILE* file = fopen(path, \"w\");\n"
+    "\tif (file == 0)\n"
+    "\t\treturn 0;\n"
+    "\tfprintf(file, \"{\\\"traceEvents\\\":[\");\n"
+    "\tint first = 1;\n"
+    "\tfor (profiler_thread* thread = atomic_load(&profilerThreads); thread != 0; thread = thread->next) {\n"
+    "\t\tconst size_t count = (thread->head < PROFILER_RING_SIZE) ? thread->head : PROFILER_RING_SIZE;\n"
+    "\t\tfor (size_t i = thread->head - count; i < thread->head; ++i) {\n"
+    "\t\t\tconst profiler_record* record = &thread->records[i & (PROFILER_RING_SIZE - 1u)];\n"
+    "\t\t\tfprintf(file, \"%s\\n{\\\"name\\\":\\\"%s\\\",\\\"ph\\\":\\\"X\\\",\\\"pid\\\":0,\\\"tid\\\":%zu,\\\"ts\\\":%.3f,\\\"dur\\\":%.3f,\"\n"
+    "\t\t\t\t\"\\\"args\\\":{\\\"visited\\\":%llu,\\\"matched\\\":%llu,\\\"structural\\\":%llu}}\",\n"
+    "\t\t\t\tfirst ? \"\" : \",\", record->name, thread->threadID, (double)record->begin / 1000.0, (double)(record->end - record->begin) / 1000.0,\n"
+    "\t\t\t\t(unsigned long long)record->visited, (unsigned long long)record->matched, (unsigned long long)record->structural);\n"
+    "\t\t\tfirst = 0;\n"
+    "\t\t}\n"
+    "\t}\n"
+    "\tfprintf(file, \"\\n]}\\n\");\n"
+    "\treturn fclose(file) == 0;\n"
+    "}\n"
+    "\n";
 }
 
-string generate_c_after_components_definition(const vector<definition_info>& definitions) {
-    string destroyComponentSector;
+string generate_c_world(const vector<definition_info>& definitions, const generator_options& options) {
+    size_t tagCount = 0;
+    string eventsSector;
+    string storageSector;
+    for (const auto& i : definitions) {
+        if (i.type == DEFINITION_TYPE_TAG_COMPONENT) {
+            ++tagCount;
+        } else if (i.type == DEFINITION_TYPE_EVENT) {
+            const auto& name = i.opcode.at(0);
+            eventsSector += "\t" + name + "_queue " + name + "Events;\n";
+        } else if (i.type == DEFINITION_TYPE_GROUP) {
+            const string name = group_name(i);
+            eventsSector += "\t" + name + "_group " + name + "Group;\n";
+        } else if (i.type == DEFINITION_TYPE_COMPONENT) {
+            if (is_buffered_component(i)) {
+                const auto& name = i.opcode.at(0);
+                eventsSector +=
+                "\t" + name + "_snapshot " + name + "Snapshots[3]; // triple buffer: written, ready, read\n"
+                "\tsize_t " + name + "Writing; // owned by the simulation thread\n"
+                "\t_Alignas(64) _Atomic size_t " + name + "Ready; // index of the last published snapshot, | 4 until it is acquired\n"
+                "\t_Alignas(64) size_t " + name + "Reading; // owned by the reader thread\n";
+            }
+            for (const auto& member : members_of(definitions, i)) {
+                if (is_indexed_member(member)) {
+                    const string prefix = i.opcode.at(0) + "_" + member.opcode.at(1);
+                    eventsSector +=
+                    "\tentity_t " + prefix + "Index[INDEX_CAPACITY]; // first entity of every key, NO_ENTITY in empty slots\n"
+                    "\tentity_t " + prefix + "Next[MAX_ENTITY_COUNT]; // entities with the same key are chained\n"
+                    "\tentity_t " + prefix + "Prev[MAX_ENTITY_COUNT];\n";
+                }
+            }
+            if (options.shm)
+                storageSector += "\t" + i.opcode.at(0) + " " + i.opcode.at(0) + "Storage[MAX_ENTITY_COUNT];\n";
+        }
+    }
+    const string headerSector = !options.shm ? string() : string(
+    "// first bytes of the shared memory object, the world follows at worldOffset.\n"
+    "// Offsets are relative to the world, so tools that do not include this code can read it too\n"
+    "typedef struct shm_header {\n"
+    "\tuint64_t magic;\n"
+    "\tsize_t worldOffset;\n"
+    "\tsize_t worldSize;\n"
+    "\tsize_t maxEntityCount;\n"
+    "\tsize_t componentCount;\n"
+    "\tsize_t componentsDataOffset; // component_info[COMPONENT_COUNT][MAX_ENTITY_COUNT]\n"
+    "\tsize_t existMaskOffset; // int[MAX_ENTITY_COUNT]\n"
+    "\tsize_t maxIDOffset;\n"
+    "\tsize_t freeHeadOffset; // uint64_t, first free id in the low 32 bits (FREE_LIST_END if none), an ABA tag in the high ones\n"
+    "\tsize_t freeNextOffset; // uint32_t[MAX_ENTITY_COUNT], the free id after every free id\n"
+    "\tsize_t idCachesOffset; // id_cache[ECS_MAX_THREADS], free ids held by the threads of the writer\n"
+    "\tsize_t componentStorageOffsets[COMPONENT_COUNT]; // by component id, entity e is at offset + e * size\n"
+    "\tsize_t componentSizes[COMPONENT_COUNT];\n"
+    "\tuintptr_t writerBase; // address of the world in the writer, component_info.data points relative to it\n"
+    "\t_Alignas(64) _Atomic uint64_t sequence; // seqlock, odd while the writer changes the world\n"
+    "} shm_header;\n");
+    return
+    headerSector +
+    "// free ids reserved by one thread, only that thread touches it\n"
+    "typedef struct id_cache {\n"
+    "\t_Alignas(64) size_t count;\n"
+    "\tentity_t ids[ID_CACHE_SIZE];\n"
+    "} id_cache;\n"
+    "\n"
+    "typedef struct world {\n"
+    "\tcomponent_info componentsData[COMPONENT_COUNT][MAX_ENTITY_COUNT];\n"
+    "\tint existMask[MAX_ENTITY_COUNT];\n"
+    "\tuint64_t componentMask[MAX_ENTITY_COUNT][COMPONENT_MASK_WORDS]; // data components, bit (id % 64) of word id / 64\n"
+    + (tagCount ? string("\tuint64_t tagMask[MAX_ENTITY_COUNT][TAG_MASK_WORDS];\n") : string()) +
+    "\t_Atomic entity_t max_id;\n"
+    "\t_Atomic uint64_t freeHead; // lock-free stack of free ids linked through freeNext\n"
+    "\t_Atomic uint32_t freeNext[MAX_ENTITY_COUNT];\n"
+    "\tid_cache idCaches[ECS_MAX_THREADS];\n"
+    "\tentity_t parent[MAX_ENTITY_COUNT];\n"
+    "\tentity_t firstChild[MAX_ENTITY_COUNT];\n"
+    "\tentity_t nextSibling[MAX_ENTITY_COUNT]; // the children of a parent are doubly linked, only valid while parent is set\n"
+    "\tentity_t prevSibling[MAX_ENTITY_COUNT];\n"
+    "\tsize_t depth[MAX_ENTITY_COUNT];\n"
+    "\tsize_t depthStart[MAX_ENTITY_COUNT + 1];\n"
+    "\tentity_t hierarchyOrder[MAX_ENTITY_COUNT];\n"
+    "\tsize_t hierarchyCount; // ids ordered by hierarchyOrder, the ones above are roots made since\n"
+    "\tint hierarchyDirty; // a link changed or the ids were compacted\n"
+    + eventsSector
+    + storageSector
+    + (options.shm ? string("\tshm_header* header; // 0 unless the world was made by world_create_shared, only valid in the writer\n") : string()) +
+    "} world;\n";
+}
+
+// the world in a posix shared memory object: one writer process, any number of read-only observers
+string generate_c_shared_world(const string& layoutSector, const string& viewSector) {
+    return
+    "#define WORLD_SHM_MAGIC 0x31646c726f777365u\n"
+    "#define WORLD_SHM_OFFSET ((sizeof(shm_header) + 63u) & ~(size_t)63u)\n"
+    "\n"
+    "// creates or resets the object name (\"/something\") and maps a fresh world into it\n"
+    "world* world_create_shared(const char* name) {\n"
+    "\tconst int fd = shm_open(name, O_CREAT | O_RDWR, 0644);\n"
+    "\tif (fd < 0)\n"
+    "\t\treturn 0;\n"
+    "\tconst size_t size = WORLD_SHM_OFFSET + sizeof(world);\n"
+    "\tif (ftruncate(fd, (off_t)size) != 0) {\n"
+    "\t\tclose(fd);\n"
+    "\t\treturn 0;\n"
+    "\t}\n"
+    "\tvoid* memory = mmap(0, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);\n"
+    "\tclose(fd);\n"
+    "\tif (memory == MAP_FAILED)\n"
+    "\t\treturn 0;\n"
+    "\tmemset(memory, 0, size);\n"
+    "\tshm_header* header = (shm_header*)memory;\n"
+    "\tworld* w = (world*)((char*)memory + WORLD_SHM_OFFSET);\n"
+    "\tworld_init(w);\n"
+    "\tw->header = header;\n"
+    "\theader->worldOffset = WORLD_SHM_OFFSET;\n"
+    "\theader->worldSize = sizeof(world);\n"
+    "\theader->maxEntityCount = MAX_ENTITY_COUNT;\n"
+    "\theader->componentCount = COMPONENT_COUNT;\n"
+    "\theader->componentsDataOffset = offsetof(world, componentsData);\n"
+    "\theader->existMaskOffset = offsetof(world, existMask);\n"
+    "\theader->maxIDOffset = offsetof(world, max_id);\n"
+    "\theader->freeHeadOffset = offsetof(world, freeHead);\n"
+    "\theader->freeNextOffset = offsetof(world, freeNext);\n"
+    "\theader->idCachesOffset = offsetof(world, idCaches);\n"
+    + layoutSector +
+    "\theader->writerBase = (uintptr_t)w;\n"
+    "\tatomic_init(&header->sequence, 0u);\n"
+    "\tatomic_thread_fence(memory_order_release);\n"
+    "\theader->magic = WORLD_SHM_MAGIC;\n"
+    "\treturn w;\n"
+    "}\n"
+    "\n"
+    "// unmaps the world and removes the object, attached observers keep their mapping\n"
+    "void world_destroy_shared(world* w, const char* name) {\n"
+    "\tmunmap(w->header, WORLD_SHM_OFFSET + sizeof(world));\n"
+    "\tshm_unlink(name);\n"
+    "}\n"
+    "\n"
+    "// observers see a consistent world only between a read_begin and a read_retry that returns 0.\n"
+    "// Changes made outside of a begin_write / end_write pair can be seen half done\n"
+    "void world_begin_write(world* w) {\n"
+    "\tif (w->header == 0)\n"
+    "\t\treturn;\n"
+    "\tatomic_fetch_add_explicit(&w->header->sequence, 1u, memory_order_relaxed);\n"
+    "\tatomic_thread_fence(memory_order_release);\n"
+    "}\n"
+    "\n"
+    "void world_end_write(world* w) {\n"
+    "\tif (w->header != 0)\n"
+    "\t\tatomic_fetch_add_explicit(&w->header->sequence, 1u, memory_order_release);\n"
+    "}\n"
+    "\n"
+    "typedef struct world_view {\n"
+    "\tconst shm_header* header;\n"
+    "\tconst world* world;\n"
+    "} world_view;\n"
+    "\n"
+    "// maps the world read-only, returns 0 if it is missing or was generated from another schema\n"
+    "int world_attach(world_view* view, const char* name) {\n"
+    "\tconst int fd = shm_open(name, O_RDONLY, 0);\n"
+    "\tif (fd < 0)\n"
+    "\t\treturn 0;\n"
+    "\tstruct stat info;\n"
+    "\tconst size_t size = WORLD_SHM_OFFSET + sizeof(world);\n"
+    "\tif ((fstat(fd, &info) != 0) || ((size_t)info.st_size != size)) {\n"
+    "\t\tclose(fd);\n"
+    "\t\treturn 0;\n"
+    "\t}\n"
+    "\tvoid* memory = mmap(0, size, PROT_READ, MAP_SHARED, fd, 0);\n"
+    "\tclose(fd);\n"
+    "\tif (memory == MAP_FAILED)\n"
+    "\t\treturn 0;\n"
+    "\tview->header = (const shm_header*)memory;\n"
+    "\tview->world = (const world*)((const char*)memory + WORLD_SHM_OFFSET);\n"
+    "\tatomic_thread_fence(memory_order_acquire);\n"
+    "\tif ((view->header->magic != WORLD_SHM_MAGIC) || (view->header->worldSize != sizeof(world)) || (view->header->componentCount != COMPONENT_COUNT)) {\n"
+    "\t\tmunmap(memory, size);\n"
+    "\t\treturn 0;\n"
+    "\t}\n"
+    "\treturn 1;\n"
+    "}\n"
+    "\n"
+    "void world_detach(world_view* view) {\n"
+    "\tmunmap((void*)view->header, WORLD_SHM_OFFSET + sizeof(world));\n"
+    "}\n"
+    "\n"
+    "// never blocks the writer: read in place, then retry if the world changed meanwhile\n"
+    "uint64_t world_read_begin(const world_view* view) {\n"
+    "\tuint64_t sequence;\n"
+    "\twhile ((sequence = atomic_load_explicit(&((shm_header*)view->header)->sequence, memory_order_acquire)) & 1u)\n"
+    "\t\t;\n"
+    "\treturn sequence;\n"
+    "}\n"
+    "\n"
+    "int world_read_retry(const world_view* view, uint64_t sequence) {\n"
+    "\tatomic_thread_fence(memory_order_acquire);\n"
+    "\treturn atomic_load_explicit(&((shm_header*)view->header)->sequence, memory_order_relaxed) != sequence;\n"
+    "}\n"
+    "\n"
+    "int view_exists(const world_view* view, entity_t entity) {\n"
+    "\treturn (entity < view->world->max_id) && view->world->existMask[entity];\n"
+    "}\n"
+    "\n"
+    + viewSector;
+}
+
+string generate_c_after_components_definition(const vector<definition_info>& definitions, const generator_options& options) {
+    const string structuralProbe = options.profile ? string("\t++profilerStructural;\n") : string();
+    const string hot = options.hints ? string("ECS_HOT ") : string();
+    const auto unlikely = [&options](const string& condition) {
+        return options.hints ? "ECS_UNLIKELY(" + condition + ")" : condition;
+    };
+    string destructorsSector;
+    std::map<size_t, string> destructorEntries; // by component id, --pgo-use reorders the ids
+    vector<string> destructibleComponents;
     string addComponentSector;
     string getComponentSector;
-    bool firstCompDef = true;
+    string destroyTagsSector;
+    string compactTagsSector;
+    string clearTagsSector;
+    string groupsSector;
+    string leaveGroupsSector;
+    string initGroupsSector;
+    string compactGroupsSector;
+    string indexesSector;
+    string initIndexesSector;
+    string compactIndexesSector;
+    if (has_indexed_members(definitions)) {
+        indexesSector +=
+        "// fnv-1a of the member bytes, members are compared bytewise\n"
+        "static size_t index_hash(const void* value, size_t size) {\n"
+        "\tconst unsigned char* bytes = (const unsigned char*)value;\n"
+        "\tuint64_t hash = 14695981039346656037u;\n"
+        "\tfor (size_t i = 0u; i < size; ++i) {\n"
+        "\t\thash ^= bytes[i];\n"
+        "\t\thash *= 1099511628211u;\n"
+        "\t}\n"
+        "\treturn (size_t)(hash % INDEX_CAPACITY);\n"
+        "}\n"
+        "\n";
+    }
+    string eventsSector;
+    string initEventsSector;
+    string clearEventsSector;
+    string snapshotsSector;
+    string initSnapshotsSector;
+    string publishSnapshotsSector;
+    string compactStorageSector;
+    string layoutSector;
+    string viewSector;
+    size_t tagCount = 0u;
     for (const auto& i : definitions) {
-        if (i.type == DEFINITION_TYPE_COMPONENT) {
+        if (i.type == DEFINITION_TYPE_GROUP) {
+            const string name = group_name(i);
+            const string group = "w->" + name + "Group";
+            string hasAllSector;
+            string joinSector;
+            string leaveSector;
+            string moveSector;
+            for (const auto& component : i.opcode) {
+                const string slot = "w->componentsData[" + find_component(definitions, component)->opcode.at(1) + "]";
+                hasAllSector += " || !" + slot + "[entity].exist";
+                joinSector +=
+                "\t" + group + "." + component + "Data[k] = *(" + component + "*)" + slot + "[entity].data;\n"
+                + (options.shm ? string() : "\tfree(" + slot + "[entity].data);\n") +
+                "\t" + slot + "[entity].data = (char*)&" + group + "." + component + "Data[k];\n"
+                "\t" + slot + "[entity].borrowed = 1;\n";
+                leaveSector +=
+                "\t" + slot + "[entity].data = 0;\n"
+                "\t" + slot + "[entity].borrowed = 0;\n";
+                moveSector +=
+                "\t\t" + group + "." + component + "Data[k] = " + group + "." + component + "Data[last];\n"
+                "\t\t" + slot + "[moved].data = (char*)&" + group + "." + component + "Data[k];\n";
+            }
+
+            groupsSector +=
+            "// moves the components of an entity into the dense arrays once it has all of them\n"
+            "void join_" + name + "_group(world* w, entity_t entity) {\n"
+            "\tif ((" + group + ".index[entity] != (size_t)-1)" + hasAllSector + ")\n"
+            "\t\treturn;\n"
+            "\tconst size_t k = " + group + ".count++;\n"
+            "\t" + group + ".entities[k] = entity;\n"
+            "\t" + group + ".index[entity] = k;\n"
+            + joinSector +
+            "}\n"
+            "\n"
+            "// the last entry fills the hole, so the arrays stay dense\n"
+            "void leave_" + name + "_group(world* w, entity_t entity) {\n"
+            "\tconst size_t k = " + group + ".index[entity];\n"
+            "\tif (k == (size_t)-1)\n"
+            "\t\treturn;\n"
+            "\tconst size_t last = --" + group + ".count;\n"
+            "\tconst entity_t moved = " + group + ".entities[last];\n"
+            + leaveSector +
+            "\tif (k != last) {\n"
+            + moveSector +
+            "\t\t" + group + ".entities[k] = moved;\n"
+            "\t\t" + group + ".index[moved] = k;\n"
+            "\t}\n"
+            "\t" + group + ".index[entity] = (size_t)-1;\n"
+            "}\n"
+            "\n";
+            leaveGroupsSector +=
+            "\tleave_" + name + "_group(w, entity);\n";
+            initGroupsSector +=
+            "\tfor (size_t i = 0u; i < MAX_ENTITY_COUNT; ++i)\n"
+            "\t\t" + group + ".index[i] = (size_t)-1;\n";
+            compactGroupsSector +=
+            "\tfor (entity_t e = 0u; e < oldMaxID; ++e)\n"
+            "\t\t" + group + ".index[e] = (size_t)-1;\n"
+            "\tfor (size_t k = 0u; k < " + group + ".count; ++k) {\n"
+            "\t\t" + group + ".entities[k] = newIDs[" + group + ".entities[k]];\n"
+            "\t\t" + group + ".index[" + group + ".entities[k]] = k;\n"
+            "\t}\n";
+        } else if (i.type == DEFINITION_TYPE_EVENT) {
+            const auto& name = i.opcode.at(0);
+            const string queue = "w->" + name + "Events";
+            initEventsSector +=
+            "\tfor (size_t i = 0u; i < EVENT_QUEUE_CAPACITY; ++i)\n"
+            "\t\tatomic_init(&" + queue + ".sequence[i], i);\n";
+            clearEventsSector +=
+            "\tend_drain_" + name + "(w, begin_drain_" + name + "(w));\n";
+
+            eventsSector +=
+            "// safe to call from any number of threads, returns 0 if the queue is full\n"
+            "int emit_" + name + "(world* w, const " + name + "* event) {\n"
+            "\tsize_t pos = atomic_load_explicit(&" + queue + ".enqueuePos, memory_order_relaxed);\n"
+            "\tfor (;;) {\n"
+            "\t\tconst size_t seq = atomic_load_explicit(&" + queue + ".sequence[pos & (EVENT_QUEUE_CAPACITY - 1u)], memory_order_acquire);\n"
+            "\t\tconst intptr_t diff = (intptr_t)seq - (intptr_t)pos;\n"
+            "\t\tif (diff == 0) {\n"
+            "\t\t\tif (atomic_compare_exchange_weak_explicit(&" + queue + ".enqueuePos, &pos, pos + 1u, memory_order_relaxed, memory_order_relaxed))\n"
+            "\t\t\t\tbreak;\n"
+            "\t\t} else if (diff < 0) {\n"
+            "\t\t\treturn 0;\n"
+            "\t\t} else {\n"
+            "\t\t\tpos = atomic_load_explicit(&" + queue + ".enqueuePos, memory_order_relaxed);\n"
+            "\t\t}\n"
+            "\t}\n"
+            "\t" + queue + ".items[pos & (EVENT_QUEUE_CAPACITY - 1u)] = *event;\n"
+            "\tatomic_store_explicit(&" + queue + ".sequence[pos & (EVENT_QUEUE_CAPACITY - 1u)], pos + 1u, memory_order_release);\n"
+            "\treturn 1;\n"
+            "}\n"
+            "\n"
+            "// single consumer: number of ready events starting at dequeuePos\n"
+            "size_t begin_drain_" + name + "(world* w) {\n"
+            "\tsize_t count = 0u;\n"
+            "\tfor (; count < EVENT_QUEUE_CAPACITY; ++count) {\n"
+            "\t\tconst size_t pos = " + queue + ".dequeuePos + count;\n"
+            "\t\tif (atomic_load_explicit(&" + queue + ".sequence[pos & (EVENT_QUEUE_CAPACITY - 1u)], memory_order_acquire) != (pos + 1u))\n"
+            "\t\t\tbreak;\n"
+            "\t}\n"
+            "\treturn count;\n"
+            "}\n"
+            "\n"
+            "// hands the first count slots back to the producers\n"
+            "void end_drain_" + name + "(world* w, size_t count) {\n"
+            "\tfor (size_t i = 0u; i < count; ++i) {\n"
+            "\t\tconst size_t pos = " + queue + ".dequeuePos + i;\n"
+            "\t\tatomic_store_explicit(&" + queue + ".sequence[pos & (EVENT_QUEUE_CAPACITY - 1u)], pos + EVENT_QUEUE_CAPACITY, memory_order_release);\n"
+            "\t}\n"
+            "\t" + queue + ".dequeuePos += count;\n"
+            "}\n"
+            "\n";
+        } else if (i.type == DEFINITION_TYPE_TAG_COMPONENT) {
+            ++tagCount;
+            const auto& name = i.opcode.at(0);
+            const string word = "w->" + generate_c_tag_word(i, "entity");
+            const string bit = generate_c_tag_bit(i);
+            destroyTagsSector =
+            "\tfor (size_t i = 0u; i < TAG_MASK_WORDS; ++i)\n"
+            "\t\tw->tagMask[entity][i] = 0;\n";
+            compactTagsSector =
+            "\t\tfor (size_t i = 0u; i < TAG_MASK_WORDS; ++i) {\n"
+            "\t\t\tw->tagMask[to][i] = w->tagMask[e][i];\n"
+            "\t\t\tw->tagMask[e][i] = 0;\n"
+            "\t\t}\n";
+            clearTagsSector =
+            "\t\tfor (size_t i = 0u; i < TAG_MASK_WORDS; ++i)\n"
+            "\t\t\tw->tagMask[e][i] = 0;\n";
+
+            addComponentSector +=
+            "void add_" + name + "(world* w, entity_t entity) {\n"
+            + structuralProbe +
+            "\tw->existMask[entity] = 1;\n"
+            "\t" + word + " |= " + bit + ";\n"
+            "}\n"
+            "\n"
+            "void remove_" + name + "(world* w, entity_t entity) {\n"
+            + structuralProbe +
+            "\t" + word + " &= ~" + bit + ";\n"
+            "}\n"
+            "\n";
+
+            getComponentSector +=
+            hot + "int has_" + name + "(world* w, entity_t entity) {\n"
+            "\treturn (" + word + " & " + bit + ") != 0;\n"
+            "}\n"
+            "\n";
+        } else if (i.type == DEFINITION_TYPE_COMPONENT) {
             const auto& name = i.opcode.at(0);
             const auto& componentIDStr = i.opcode.at(1);
-            destroyComponentSector +=
-            (firstCompDef ? string("\t\t\t") : string("\t\t\telse ")) + "if (i == " + componentIDStr +") {\n"
-            "\t\t\t\t" + name + "_destroy((" + name + "*)componentsData[i][entity].data);\n"
-            "\t\t\t}\n";
-            firstCompDef = false;
+            const string slot = "w->componentsData[" + componentIDStr + "]";
+
+            string eraseIndexesSector;
+            string insertIndexesSector;
+            for (const auto& member : members_of(definitions, i)) {
+                if (!is_indexed_member(member))
+                    continue;
+                const auto& typeName = member.opcode.at(0);
+                const auto& memberName = member.opcode.at(1);
+                const string index = name + "_" + memberName + "_index";
+                const string table = "w->" + name + "_" + memberName + "Index";
+                const string next = "w->" + name + "_" + memberName + "Next";
+                const string prev = "w->" + name + "_" + memberName + "Prev";
+                const string value = "((const " + name + "*)" + slot + "[entity].data)->" + memberName;
+
+                indexesSector +=
+                "// the slot of the key, or the empty one it would take\n"
+                "static size_t " + index + "_slot(world* w, const " + typeName + "* value) {\n"
+                "\tsize_t slot = index_hash(value, sizeof(" + typeName + "));\n"
+                "\twhile ((" + table + "[slot] != NO_ENTITY) && (memcmp(&((const " + name + "*)" + slot + "[" + table + "[slot]].data)->" + memberName + ", value, sizeof(" + typeName + ")) != 0))\n"
+                "\t\tslot = (slot + 1u) % INDEX_CAPACITY;\n"
+                "\treturn slot;\n"
+                "}\n"
+                "\n"
+                "// equal keys share one slot, so duplicates never make the probes longer\n"
+                "static void " + index + "_insert(world* w, entity_t entity) {\n"
+                "\tconst size_t slot = " + index + "_slot(w, &" + value + ");\n"
+                "\t" + next + "[entity] = " + table + "[slot];\n"
+                "\t" + prev + "[entity] = NO_ENTITY;\n"
+                "\tif (" + table + "[slot] != NO_ENTITY)\n"
+                "\t\t" + prev + "[" + table + "[slot]] = entity;\n"
+                "\t" + table + "[slot] = entity;\n"
+                "}\n"
+                "\n"
+                "// the slot is only looked up for the first entity of a key, and freed with backward shift\n"
+                "// deletion when it was the last one, the table never fills up with tombstones\n"
+                "static void " + index + "_erase(world* w, entity_t entity) {\n"
+                "\tif (" + next + "[entity] != NO_ENTITY)\n"
+                "\t\t" + prev + "[" + next + "[entity]] = " + prev + "[entity];\n"
+                "\tif (" + prev + "[entity] != NO_ENTITY) {\n"
+                "\t\t" + next + "[" + prev + "[entity]] = " + next + "[entity];\n"
+                "\t\treturn;\n"
+                "\t}\n"
+                "\tsize_t hole = " + index + "_slot(w, &" + value + ");\n"
+                "\tif (" + next + "[entity] != NO_ENTITY) {\n"
+                "\t\t" + table + "[hole] = " + next + "[entity];\n"
+                "\t\treturn;\n"
+                "\t}\n"
+                "\tfor (size_t next = (hole + 1u) % INDEX_CAPACITY; " + table + "[next] != NO_ENTITY; next = (next + 1u) % INDEX_CAPACITY) {\n"
+                "\t\tconst entity_t moved = " + table + "[next];\n"
+                "\t\tconst size_t home = index_hash(&((const " + name + "*)" + slot + "[moved].data)->" + memberName + ", sizeof(" + typeName + "));\n"
+                "\t\tif (((next + INDEX_CAPACITY - home) % INDEX_CAPACITY) >= ((next + INDEX_CAPACITY - hole) % INDEX_CAPACITY)) {\n"
+                "\t\t\t" + table + "[hole] = moved;\n"
+                "\t\t\thole = next;\n"
+                "\t\t}\n"
+                "\t}\n"
+                "\t" + table + "[hole] = NO_ENTITY;\n"
+                "}\n"
+                "\n"
+                "// the first of the entities whose " + memberName + " equals value, NO_ENTITY if there is none\n"
+                "entity_t find_" + name + "_by_" + memberName + "(world* w, " + typeName + " value) {\n"
+                "\treturn " + table + "[" + index + "_slot(w, &value)];\n"
+                "}\n"
+                "\n"
+                "// the next entity with the same " + memberName + ", NO_ENTITY after the last one\n"
+                "entity_t find_next_" + name + "_by_" + memberName + "(world* w, entity_t entity) {\n"
+                "\treturn " + next + "[entity];\n"
+                "}\n"
+                "\n"
+                "// writes through get_" + name + " bypass the index, change " + memberName + " with this setter\n"
+                "void set_" + name + "_" + memberName + "(world* w, entity_t entity, " + typeName + " value) {\n"
+                "\tif (" + slot + "[entity].exist == 0)\n"
+                "\t\treturn;\n"
+                "\t" + index + "_erase(w, entity);\n"
+                "\t((" + name + "*)" + slot + "[entity].data)->" + memberName + " = value;\n"
+                "\t" + index + "_insert(w, entity);\n"
+                "}\n"
+                "\n";
+                eraseIndexesSector += "\t" + index + "_erase(w, entity);\n";
+                insertIndexesSector += "\t" + index + "_insert(w, entity);\n";
+                initIndexesSector +=
+                "\tfor (size_t i = 0u; i < INDEX_CAPACITY; ++i)\n"
+                "\t\t" + table + "[i] = NO_ENTITY;\n";
+                compactIndexesSector +=
+                "\tfor (size_t i = 0u; i < INDEX_CAPACITY; ++i)\n"
+                "\t\t" + table + "[i] = NO_ENTITY;\n"
+                "\tfor (entity_t entity = 0u; entity < count; ++entity) {\n"
+                "\t\tif (" + slot + "[entity].exist)\n"
+                "\t\t\t" + index + "_insert(w, entity);\n"
+                "\t}\n";
+            }
+
+            if (is_trivially_destructible(definitions, name) && eraseIndexesSector.empty()) {
+                destructorEntries[std::stoul(componentIDStr)] = "\t0, // " + name + "\n";
+            } else {
+                destructibleComponents.emplace_back(name);
+                destructorEntries[std::stoul(componentIDStr)] = "\tdestroy_" + name + "_component,\n";
+                destructorsSector +=
+                "static void destroy_" + name + "_component(world* w, entity_t entity) {\n"
+                + eraseIndexesSector +
+                "\t" + name + "_destroy((" + name + "*)" + slot + "[entity].data);\n"
+                "}\n"
+                "\n";
+            }
 
             addComponentSector +=
-            "void add_" + name+ "(entity_t entity) {\n"
-            "\tcomponentsData[" + componentIDStr + "][entity].exist = 1;\n"
-            "\texistMask[entity] = 1;\n"
-            "\tif (componentsData[" + componentIDStr + "][entity].data == 0) {\n"
-            "\t\tcomponentsData[" + componentIDStr + "][entity].data = malloc(sizeof(" + name + "));\n"
-            "\t\tcomponentsData[" + componentIDStr + "][entity].dataSize = sizeof(" + name + ");\n"
+            "void add_" + name+ "(world* w, entity_t entity) {\n"
+            + structuralProbe
+            + (eraseIndexesSector.empty() ? string() : "\tif (" + slot + "[entity].exist) {\n" + indent_lines(eraseIndexesSector, "\t") + "\t}\n") +
+            "\tw->componentsData[" + componentIDStr + "][entity].exist = 1;\n"
+            "\tw->componentMask[entity][" + to_string(std::stoul(componentIDStr) / 64u) + "] |= (uint64_t)1u << " + to_string(std::stoul(componentIDStr) % 64u) + ";\n"
+            "\tw->existMask[entity] = 1;\n"
+            "\tif (w->componentsData[" + componentIDStr + "][entity].data == 0) {\n"
+            + (options.shm
+                ? "\t\tw->componentsData[" + componentIDStr + "][entity].data = (char*)&w->" + name + "Storage[entity];\n"
+                  "\t\tw->componentsData[" + componentIDStr + "][entity].borrowed = 1;\n"
+                : "\t\tw->componentsData[" + componentIDStr + "][entity].data = malloc(sizeof(" + name + "));\n") +
+            "\t\tw->componentsData[" + componentIDStr + "][entity].dataSize = sizeof(" + name + ");\n"
             "\t}\n"
             "\tfor (size_t i = 0u; i < sizeof(" + name + "); ++i)\n"
-            "\t\tcomponentsData[" + componentIDStr + "][entity].data[i] = 0;\n"
+            "\t\tw->componentsData[" + componentIDStr + "][entity].data[i] = 0;\n"
+            + (find_owning_group(definitions, name) ? "\tjoin_" + group_name(*find_owning_group(definitions, name)) + "_group(w, entity);\n" : string())
+            + insertIndexesSector +
             "}\n"
             "\n";
 
+            if (is_buffered_component(i)) {
+                snapshotsSector +=
+                "// simulation thread: copies the live " + name + " data into the written buffer and swaps it with the ready one\n"
+                "static void publish_" + name + "_snapshot(world* w) {\n"
+                "\t" + name + "_snapshot* snapshot = &w->" + name + "Snapshots[w->" + name + "Writing];\n"
+                "\tconst entity_t maxID = atomic_load_explicit(&w->max_id, memory_order_relaxed);\n"
+                "\tsnapshot->count = maxID;\n"
+                "\tfor (entity_t entity = 0u; entity < maxID; ++entity) {\n"
+                "\t\tsnapshot->exist[entity] = (unsigned char)" + slot + "[entity].exist;\n"
+                "\t\tif (snapshot->exist[entity])\n"
+                "\t\t\tsnapshot->data[entity] = *(const " + name + "*)" + slot + "[entity].data;\n"
+                "\t}\n"
+                "\tw->" + name + "Writing = atomic_exchange_explicit(&w->" + name + "Ready, w->" + name + "Writing | 4u, memory_order_acq_rel) & 3u;\n"
+                "}\n"
+                "\n"
+                "// one reader thread: the snapshot published by the last world_end_tick, no locks are taken.\n"
+                "// It stays valid and unchanged until the next call, ids are the ones of that tick\n"
+                "const " + name + "_snapshot* acquire_" + name + "_snapshot(world* w) {\n"
+                "\tif (atomic_load_explicit(&w->" + name + "Ready, memory_order_relaxed) & 4u)\n"
+                "\t\tw->" + name + "Reading = atomic_exchange_explicit(&w->" + name + "Ready, w->" + name + "Reading, memory_order_acq_rel) & 3u;\n"
+                "\treturn &w->" + name + "Snapshots[w->" + name + "Reading];\n"
+                "}\n"
+                "\n";
+                initSnapshotsSector +=
+                "\tw->" + name + "Writing = 0u;\n"
+                "\tatomic_init(&w->" + name + "Ready, 1u);\n"
+                "\tw->" + name + "Reading = 2u;\n";
+                publishSnapshotsSector +=
+                "\tpublish_" + name + "_snapshot(w);\n";
+            }
+
+            if (options.shm) {
+                const string storage = "w->" + name + "Storage";
+                // the slots were swapped, the storage entry has to follow its slot
+                compactStorageSector +=
+                "\t\tif (" + slot + "[to].data == (char*)&" + storage + "[e]) {\n"
+                "\t\t\t" + storage + "[to] = " + storage + "[e];\n"
+                "\t\t\t" + slot + "[to].data = (char*)&" + storage + "[to];\n"
+                "\t\t}\n"
+                "\t\tif (" + slot + "[e].data == (char*)&" + storage + "[to])\n"
+                "\t\t\t" + slot + "[e].data = (char*)&" + storage + "[e];\n";
+                layoutSector +=
+                "\theader->componentStorageOffsets[" + componentIDStr + "] = offsetof(world, " + name + "Storage);\n"
+                "\theader->componentSizes[" + componentIDStr + "] = sizeof(" + name + ");\n";
+                viewSector +=
+                hot + "const " + name + "* view_" + name + "(const world_view* view, entity_t entity) {\n"
+                "\tconst component_info* info = &view->world->componentsData[" + componentIDStr + "][entity];\n"
+                "\tif (" + unlikely("!info->exist || (info->data == 0)") + ")\n"
+                "\t\treturn 0;\n"
+                "\treturn (const " + name + "*)((const char*)view->world + ((uintptr_t)info->data - view->header->writerBase));\n"
+                "}\n"
+                "\n";
+            }
+
             getComponentSector +=
-            name + "* get_" + name + "(entity_t entity) {\n"
-            "\tif (componentsData[" + componentIDStr + "][entity].exist == 0)\n"
+            hot + name + "* get_" + name + "(world* w, entity_t entity) {\n"
+            + (options.pgoInstrument ? "\tatomic_fetch_add_explicit(&pgoComponentReads[" + componentIDStr + "], 1u, memory_order_relaxed);\n" : string()) +
+            "\tif (" + unlikely("w->componentsData[" + componentIDStr + "][entity].exist == 0") + ")\n"
             "\t\treturn 0;\n"
-            "\treturn (" + name + "*)componentsData[" + componentIDStr + "][entity].data;\n"
+            "\treturn (" + name + "*)w->componentsData[" + componentIDStr + "][entity].data;\n"
             "}\n"
             "\n";
         }
     }
 
+    string destructorsTableSector;
+    for (const auto& entry : destructorEntries)
+        destructorsTableSector += entry.second;
+
+    const string tagQuerySector = tagCount ? string(
+    "\t\tfor (size_t word = 0u; (tags != 0) && (word < TAG_MASK_WORDS); ++word)\n"
+    "\t\t\tmissing |= tags[word] & ~w->tagMask[e][word];\n") : string();
+
     return
-    "entity_t create() {\n"
-    "\tif (freeIDCount == 0) {\n"
-    "\t\treturn max_id++;\n"
-    "\t} else {\n"
-    "\t\t--freeIDCount;\n"
-    "\t\treturn freeIDs[freeIDCount];\n"
+    groupsSector
+    + indexesSector
+    + destructorsSector +
+    "// trivially destructible components have no entry and are never visited by destroy_entity\n"
+    "static void (*const componentDestructors[COMPONENT_COUNT])(world* w, entity_t entity) = {\n"
+    + destructorsTableSector +
+    "};\n"
+    "static const uint64_t destructibleComponents[COMPONENT_MASK_WORDS] = " + generate_c_mask_initializer(mask_words(definitions, destructibleComponents, DEFINITION_TYPE_COMPONENT)) + ";\n"
+    "\n"
+    "// ids live in a lock-free stack shared by the threads and in a cache per thread,\n"
+    "// so create() and the release of the id by destroy_entity() are safe on any thread\n"
+    "static _Atomic int idCacheOwned[ECS_MAX_THREADS]; // 1 while a thread, or a drain, holds the cache in every world\n"
+    "static _Thread_local size_t idCacheSlot = 0u; // 1 + the cache of this thread in every world, 0 before its first id\n"
+    "\n"
+    "// a thread takes over the ids a released thread left in its slot\n"
+    "static id_cache* thread_id_cache(world* w) {\n"
+    "\tif (idCacheSlot == 0u) {\n"
+    "\t\tidCacheSlot = ECS_MAX_THREADS + 1u; // without a free slot the thread goes through the stack, it does not scan again\n"
+    "\t\tfor (size_t i = 0u; i < ECS_MAX_THREADS; ++i) {\n"
+    "\t\t\tint owned = 0;\n"
+    "\t\t\tif (atomic_compare_exchange_strong_explicit(&idCacheOwned[i], &owned, 1, memory_order_acquire, memory_order_relaxed)) {\n"
+    "\t\t\t\tidCacheSlot = i + 1u;\n"
+    "\t\t\t\tbreak;\n"
+    "\t\t\t}\n"
+    "\t\t}\n"
     "\t}\n"
+    "\treturn (idCacheSlot <= ECS_MAX_THREADS) ? &w->idCaches[idCacheSlot - 1u] : 0;\n"
     "}\n"
     "\n"
-    "void destroy_entity(entity_t entity) {\n"
-    "\texistMask[entity] = 0;\n"
-    "\tfor (size_t i = 0u; i < COMPONENT_COUNT; ++i) {\n"
-    "\t\tif (componentsData[i][entity].exist) {\n"
-    "\t\t\tcomponentsData[i][entity].exist = 0;\n"
-    + destroyComponentSector +
+    "// call it before a thread exits, its slot and the ids cached there go to the next thread or back to the stacks\n"
+    "void release_thread_ids(void) {\n"
+    "\tif ((idCacheSlot != 0u) && (idCacheSlot <= ECS_MAX_THREADS))\n"
+    "\t\tatomic_store_explicit(&idCacheOwned[idCacheSlot - 1u], 0, memory_order_release);\n"
+    "\tidCacheSlot = 0u;\n"
+    "}\n"
+    "\n"
+    "// pushes the chain first..last, already linked through freeNext, with one compare and swap\n"
+    "static void push_free_ids(world* w, entity_t first, entity_t last) {\n"
+    "\tuint64_t head = atomic_load_explicit(&w->freeHead, memory_order_relaxed);\n"
+    "\tuint64_t next;\n"
+    "\tdo {\n"
+    "\t\tatomic_store_explicit(&w->freeNext[last], (uint32_t)head, memory_order_relaxed);\n"
+    "\t\tnext = (((head >> 32) + 1u) << 32) | (uint64_t)first;\n"
+    "\t} while (!atomic_compare_exchange_weak_explicit(&w->freeHead, &head, next, memory_order_release, memory_order_relaxed));\n"
+    "}\n"
+    "\n"
+    "// every push and pop bumps the tag, so a head that was popped and pushed again meanwhile fails the swap\n"
+    "static int pop_free_id(world* w, entity_t* id) {\n"
+    "\tuint64_t head = atomic_load_explicit(&w->freeHead, memory_order_acquire);\n"
+    "\tfor (;;) {\n"
+    "\t\tconst uint32_t first = (uint32_t)head;\n"
+    "\t\tif (first == FREE_LIST_END)\n"
+    "\t\t\treturn 0;\n"
+    "\t\tconst uint64_t next = (((head >> 32) + 1u) << 32) | atomic_load_explicit(&w->freeNext[first], memory_order_relaxed);\n"
+    "\t\tif (atomic_compare_exchange_weak_explicit(&w->freeHead, &head, next, memory_order_acquire, memory_order_acquire)) {\n"
+    "\t\t\t*id = first;\n"
+    "\t\t\treturn 1;\n"
     "\t\t}\n"
     "\t}\n"
-    "\tfreeIDs[freeIDCount] = entity;\n"
-    "\t++freeIDCount;\n"
     "}\n"
     "\n"
-    "void cleanup() {\n"
+    "// pushes back the ids cached in the slots no thread holds, 1 when there were any\n"
+    "static int drain_unowned_caches(world* w) {\n"
+    "\tint drained = 0;\n"
+    "\tfor (size_t i = 0u; i < ECS_MAX_THREADS; ++i) {\n"
+    "\t\tint owned = 0;\n"
+    "\t\tif (!atomic_compare_exchange_strong_explicit(&idCacheOwned[i], &owned, 1, memory_order_acquire, memory_order_relaxed))\n"
+    "\t\t\tcontinue;\n"
+    "\t\tid_cache* const cache = &w->idCaches[i];\n"
+    "\t\tif (cache->count != 0u) {\n"
+    "\t\t\tfor (size_t j = 0u; j + 1u < cache->count; ++j)\n"
+    "\t\t\t\tatomic_store_explicit(&w->freeNext[cache->ids[j]], (uint32_t)cache->ids[j + 1u], memory_order_relaxed);\n"
+    "\t\t\tpush_free_ids(w, cache->ids[0], cache->ids[cache->count - 1u]);\n"
+    "\t\t\tcache->count = 0u;\n"
+    "\t\t\tdrained = 1;\n"
+    "\t\t}\n"
+    "\t\tatomic_store_explicit(&idCacheOwned[i], 0, memory_order_release);\n"
+    "\t}\n"
+    "\treturn drained;\n"
+    "}\n"
+    "\n"
+    "// takes a free id and refills up to half of the cache with the next ones, a new id when none is free.\n"
+    "// At MAX_ENTITY_COUNT the caches of released threads are drained, the caches of live threads are not taken back\n"
+    "static entity_t create_slow(world* w, id_cache* cache) {\n"
+    "\tentity_t id;\n"
+    "\tif (!pop_free_id(w, &id)) {\n"
+    "\t\tid = atomic_load_explicit(&w->max_id, memory_order_relaxed);\n"
+    "\t\tdo {\n"
+    "\t\t\tif (id >= MAX_ENTITY_COUNT)\n"
+    "\t\t\t\treturn (drain_unowned_caches(w) && pop_free_id(w, &id)) ? id : NO_ENTITY;\n"
+    "\t\t} while (!atomic_compare_exchange_weak_explicit(&w->max_id, &id, id + 1u, memory_order_relaxed, memory_order_relaxed));\n"
+    "\t\treturn id;\n"
+    "\t}\n"
+    "\tentity_t cached;\n"
+    "\twhile ((cache != 0) && (cache->count < ID_CACHE_SIZE / 2u) && pop_free_id(w, &cached))\n"
+    "\t\tcache->ids[cache->count++] = cached;\n"
+    "\treturn id;\n"
+    "}\n"
+    "\n"
+    "// the cache keeps the last released ids, its older half goes back to the stack in one chain when it is full\n"
+    "static void release_id(world* w, entity_t entity) {\n"
+    "\tid_cache* const cache = thread_id_cache(w);\n"
+    "\tif (cache == 0) {\n"
+    "\t\tpush_free_ids(w, entity, entity);\n"
+    "\t\treturn;\n"
+    "\t}\n"
+    "\tif (cache->count == ID_CACHE_SIZE) {\n"
+    "\t\tconst size_t half = ID_CACHE_SIZE / 2u;\n"
+    "\t\tfor (size_t i = 0u; i + 1u < half; ++i)\n"
+    "\t\t\tatomic_store_explicit(&w->freeNext[cache->ids[i]], (uint32_t)cache->ids[i + 1u], memory_order_relaxed);\n"
+    "\t\tpush_free_ids(w, cache->ids[0], cache->ids[half - 1u]);\n"
+    "\t\tfor (size_t i = half; i < ID_CACHE_SIZE; ++i)\n"
+    "\t\t\tcache->ids[i - half] = cache->ids[i];\n"
+    "\t\tcache->count -= half;\n"
+    "\t}\n"
+    "\tcache->ids[cache->count++] = entity;\n"
+    "}\n"
+    "\n"
+    "// NO_ENTITY when the world is full. Every live thread may keep up to ID_CACHE_SIZE freed ids for itself,\n"
+    "// so with several threads the world can be full before MAX_ENTITY_COUNT entities are alive.\n"
+    "// Threads that call release_thread_ids() before they exit give their ids back\n"
+    "entity_t create(world* w) {\n"
+    + structuralProbe +
+    "\tid_cache* const cache = thread_id_cache(w);\n"
+    "\tif ((cache != 0) && (cache->count != 0u))\n"
+    "\t\treturn cache->ids[--cache->count];\n"
+    "\treturn create_slow(w, cache);\n"
+    "}\n"
+    "\n"
+    "// no probe, destroy_entity() detaches through it and counts as one structural change\n"
+    "static void link_parent(world* w, entity_t child, entity_t parent) {\n"
+    "\tif (w->parent[child] != NO_ENTITY) {\n"
+    "\t\tif (w->prevSibling[child] != NO_ENTITY)\n"
+    "\t\t\tw->nextSibling[w->prevSibling[child]] = w->nextSibling[child];\n"
+    "\t\telse\n"
+    "\t\t\tw->firstChild[w->parent[child]] = w->nextSibling[child];\n"
+    "\t\tif (w->nextSibling[child] != NO_ENTITY)\n"
+    "\t\t\tw->prevSibling[w->nextSibling[child]] = w->prevSibling[child];\n"
+    "\t}\n"
+    "\tw->parent[child] = parent;\n"
+    "\tif (parent != NO_ENTITY) {\n"
+    "\t\tw->nextSibling[child] = w->firstChild[parent];\n"
+    "\t\tw->prevSibling[child] = NO_ENTITY;\n"
+    "\t\tif (w->firstChild[parent] != NO_ENTITY)\n"
+    "\t\t\tw->prevSibling[w->firstChild[parent]] = child;\n"
+    "\t\tw->firstChild[parent] = child;\n"
+    "\t}\n"
+    "}\n"
+    "\n"
+    "// returns 0 and changes nothing if parent is child itself or one of its descendants\n"
+    "int set_parent(world* w, entity_t child, entity_t parent) {\n"
+    "\tfor (entity_t i = parent; i != NO_ENTITY; i = w->parent[i]) {\n"
+    "\t\tif (i == child)\n"
+    "\t\t\treturn 0;\n"
+    "\t}\n"
+    + structuralProbe +
+    "\tlink_parent(w, child, parent);\n"
+    "\tw->hierarchyDirty = 1;\n"
+    "\treturn 1;\n"
+    "}\n"
+    "\n"
+    "entity_t get_parent(world* w, entity_t entity) {\n"
+    "\treturn w->parent[entity];\n"
+    "}\n"
+    "\n"
+    "// rebuilds hierarchyOrder: every id below max_id, sorted by depth with a counting sort.\n"
+    "// Only set_parent and world_compact make it necessary: new ids, reused ids and the children\n"
+    "// of a destroyed entity are roots, and a root may be visited anywhere in the order\n"
+    "void hierarchy_update(world* w) {\n"
+    "\tif (!w->hierarchyDirty)\n"
+    "\t\treturn;\n"
+    "\tconst entity_t maxID = atomic_load_explicit(&w->max_id, memory_order_relaxed);\n"
+    "\tfor (entity_t e = 0u; e < maxID; ++e)\n"
+    "\t\tw->depth[e] = (size_t)-1;\n"
+    "\tsize_t maxDepth = 0u;\n"
+    "\tfor (entity_t e = 0u; e < maxID; ++e) {\n"
+    "\t\tsize_t steps = 0u;\n"
+    "\t\tentity_t top = e;\n"
+    "\t\twhile ((w->depth[top] == (size_t)-1) && (w->parent[top] != NO_ENTITY)) {\n"
+    "\t\t\ttop = w->parent[top];\n"
+    "\t\t\t++steps;\n"
+    "\t\t}\n"
+    "\t\tif (w->depth[top] == (size_t)-1)\n"
+    "\t\t\tw->depth[top] = 0u;\n"
+    "\t\tconst size_t topDepth = w->depth[top];\n"
+    "\t\tfor (entity_t i = e; i != top; i = w->parent[i], --steps)\n"
+    "\t\t\tw->depth[i] = topDepth + steps;\n"
+    "\t\tif (w->depth[e] > maxDepth)\n"
+    "\t\t\tmaxDepth = w->depth[e];\n"
+    "\t}\n"
+    "\tfor (size_t d = 0u; d <= maxDepth + 1u; ++d)\n"
+    "\t\tw->depthStart[d] = 0u;\n"
+    "\tfor (entity_t e = 0u; e < maxID; ++e)\n"
+    "\t\t++w->depthStart[w->depth[e] + 1u];\n"
+    "\tfor (size_t d = 1u; d <= maxDepth + 1u; ++d)\n"
+    "\t\tw->depthStart[d] += w->depthStart[d - 1u];\n"
+    "\tfor (entity_t e = 0u; e < maxID; ++e)\n"
+    "\t\tw->hierarchyOrder[w->depthStart[w->depth[e]]++] = e;\n"
+    "\tw->hierarchyCount = maxID;\n"
+    "\tw->hierarchyDirty = 0;\n"
+    "}\n"
+    "\n"
+    "void destroy_entity(world* w, entity_t entity) {\n"
+    + structuralProbe +
+    "\tw->existMask[entity] = 0;\n"
+    "\tlink_parent(w, entity, NO_ENTITY);\n"
+    "\t// the children become roots\n"
+    "\tfor (entity_t child = w->firstChild[entity]; child != NO_ENTITY; child = w->nextSibling[child])\n"
+    "\t\tw->parent[child] = NO_ENTITY;\n"
+    "\tw->firstChild[entity] = NO_ENTITY;\n"
+    "\tfor (size_t word = 0u; word < COMPONENT_MASK_WORDS; ++word) {\n"
+    "\t\tuint64_t bits = w->componentMask[entity][word];\n"
+    "\t\tw->componentMask[entity][word] = 0u;\n"
+    "\t\tfor (uint64_t owning = bits & destructibleComponents[word]; owning != 0u; owning &= owning - 1u)\n"
+    "\t\t\tcomponentDestructors[word * 64u + (size_t)ctz64(owning)](w, entity);\n"
+    "\t\tfor (; bits != 0u; bits &= bits - 1u)\n"
+    "\t\t\tw->componentsData[word * 64u + (size_t)ctz64(bits)][entity].exist = 0;\n"
+    "\t}\n"
+    + leaveGroupsSector
+    + destroyTagsSector +
+    "\trelease_id(w, entity);\n"
+    "}\n"
+    "\n"
+    "// destroys every live entity that has all the components of the query, returns how many.\n"
+    "// components has COMPONENT_MASK_WORDS words and tags TAG_MASK_WORDS, either may be 0 to match anything\n"
+    "size_t destroy_all(world* w, const uint64_t* components, const uint64_t* tags) {\n"
+    + (tagCount ? string() : string("\t(void)tags;\n")) +
+    "\tsize_t count = 0u;\n"
+    "\tconst entity_t maxID = atomic_load_explicit(&w->max_id, memory_order_relaxed);\n"
+    "\tfor (entity_t e = 0u; e < maxID; ++e) {\n"
+    "\t\tif (!w->existMask[e])\n"
+    "\t\t\tcontinue;\n"
+    "\t\tuint64_t missing = 0u;\n"
+    "\t\tfor (size_t word = 0u; (components != 0) && (word < COMPONENT_MASK_WORDS); ++word)\n"
+    "\t\t\tmissing |= components[word] & ~w->componentMask[e][word];\n"
+    + tagQuerySector +
+    "\t\tif (missing == 0u) {\n"
+    "\t\t\tdestroy_entity(w, e);\n"
+    "\t\t\t++count;\n"
+    "\t\t}\n"
+    "\t}\n"
+    "\treturn count;\n"
+    "}\n"
+    "\n"
+    "// destroyed slots keep their buffers for reuse, so they are freed here as well\n"
+    "void cleanup(world* w) {\n"
+    "\tconst entity_t maxID = atomic_load_explicit(&w->max_id, memory_order_relaxed);\n"
     "\tfor (size_t i = 0u; i < COMPONENT_COUNT; ++i) {\n"
-    "\t\tfor (size_t j = 0u; j < max_id; ++j) {\n"
-    "\t\t\tif (componentsData[i][j].exist && componentsData[i][j].data != 0) {\n"
-    "\t\t\t\tfree(componentsData[i][j].data);\n"
+    "\t\tfor (size_t j = 0u; j < maxID; ++j) {\n"
+    "\t\t\tif (w->componentsData[i][j].data != 0 && !w->componentsData[i][j].borrowed) {\n"
+    "\t\t\t\tfree(w->componentsData[i][j].data);\n"
     "\t\t\t}\n"
     "\t\t}\n"
     "\t}\n"
     "}\n"
     "\n"
+    "// renumbers the live entities densely, keeping their order, and lowers max_id.\n"
+    "// remap (max_id entries, may be 0) receives the new id of every old id, NO_ENTITY for dead ones,\n"
+    "// entity ids stored inside components have to be translated with it. Returns the new max_id.\n"
+    "// No other thread may create or destroy entities meanwhile, the free ids of every thread are dropped\n"
+    "entity_t world_compact(world* w, entity_t* remap) {\n"
+    "\tconst entity_t oldMaxID = atomic_load_explicit(&w->max_id, memory_order_relaxed);\n"
+    "\tentity_t* newIDs = (remap != 0) ? remap : (entity_t*)malloc((oldMaxID + 1u) * sizeof(entity_t));\n"
+    "\tif (newIDs == 0)\n"
+    "\t\treturn oldMaxID;\n"
+    "\tfor (entity_t e = 0u; e < oldMaxID; ++e)\n"
+    "\t\tnewIDs[e] = 0u;\n"
+    "\tfor (uint32_t i = (uint32_t)atomic_load(&w->freeHead); i != FREE_LIST_END; i = atomic_load_explicit(&w->freeNext[i], memory_order_relaxed))\n"
+    "\t\tnewIDs[i] = NO_ENTITY;\n"
+    "\tfor (size_t t = 0u; t < ECS_MAX_THREADS; ++t) {\n"
+    "\t\tfor (size_t i = 0u; i < w->idCaches[t].count; ++i)\n"
+    "\t\t\tnewIDs[w->idCaches[t].ids[i]] = NO_ENTITY;\n"
+    "\t\tw->idCaches[t].count = 0u;\n"
+    "\t}\n"
+    "\tentity_t count = 0u;\n"
+    "\tfor (entity_t e = 0u; e < oldMaxID; ++e) {\n"
+    "\t\tif (newIDs[e] != NO_ENTITY)\n"
+    "\t\t\tnewIDs[e] = count++;\n"
+    "\t}\n"
+    "\t// the new id is never above the old one, so every target slot is dead or already moved out\n"
+    "\tfor (entity_t e = 0u; e < oldMaxID; ++e) {\n"
+    "\t\tconst entity_t to = newIDs[e];\n"
+    "\t\tif ((to == NO_ENTITY) || (to == e))\n"
+    "\t\t\tcontinue;\n"
+    "\t\tfor (size_t i = 0u; i < COMPONENT_COUNT; ++i) {\n"
+    "\t\t\tconst component_info moved = w->componentsData[i][to];\n"
+    "\t\t\tw->componentsData[i][to] = w->componentsData[i][e];\n"
+    "\t\t\tw->componentsData[i][e] = moved;\n"
+    "\t\t}\n"
+    "\t\tw->existMask[to] = w->existMask[e];\n"
+    "\t\tw->existMask[e] = 0;\n"
+    "\t\tfor (size_t i = 0u; i < COMPONENT_MASK_WORDS; ++i) {\n"
+    "\t\t\tw->componentMask[to][i] = w->componentMask[e][i];\n"
+    "\t\t\tw->componentMask[e][i] = 0u;\n"
+    "\t\t}\n"
+    + compactTagsSector +
+    "\t\tw->parent[to] = w->parent[e];\n"
+    + compactStorageSector +
+    "\t}\n"
+    "\t// the sibling links are rebuilt from the renumbered parents\n"
+    "\tfor (entity_t e = 0u; e < count; ++e)\n"
+    "\t\tw->firstChild[e] = NO_ENTITY;\n"
+    "\tfor (entity_t e = 0u; e < count; ++e) {\n"
+    "\t\tconst entity_t parent = w->parent[e];\n"
+    "\t\tif (parent != NO_ENTITY) {\n"
+    "\t\t\tw->parent[e] = NO_ENTITY;\n"
+    "\t\t\tlink_parent(w, e, newIDs[parent]);\n"
+    "\t\t}\n"
+    "\t}\n"
+    "\t// dead slots above the new max_id give their buffers back\n"
+    "\tfor (entity_t e = count; e < oldMaxID; ++e) {\n"
+    "\t\tfor (size_t i = 0u; i < COMPONENT_COUNT; ++i) {\n"
+    + (options.shm ? string() : string("\t\t\tfree(w->componentsData[i][e].data);\n")) +
+    "\t\t\tw->componentsData[i][e].data = 0;\n"
+    "\t\t\tw->componentsData[i][e].exist = 0;\n"
+    "\t\t}\n"
+    "\t\tw->existMask[e] = 0;\n"
+    "\t\tfor (size_t i = 0u; i < COMPONENT_MASK_WORDS; ++i)\n"
+    "\t\t\tw->componentMask[e][i] = 0u;\n"
+    + clearTagsSector +
+    "\t\tw->parent[e] = NO_ENTITY;\n"
+    "\t\tw->firstChild[e] = NO_ENTITY;\n"
+    "\t}\n"
+    + compactGroupsSector
+    + compactIndexesSector +
+    "\tif (remap == 0)\n"
+    "\t\tfree(newIDs);\n"
+    "\tatomic_store_explicit(&w->max_id, count, memory_order_relaxed);\n"
+    "\tatomic_store(&w->freeHead, FREE_LIST_END);\n"
+    "\tw->hierarchyDirty = 1;\n"
+    "\treturn count;\n"
+    "}\n"
+    "\n"
+    "// w has to be zeroed\n"
+    "static void world_init(world* w) {\n"
+    "\tfor (size_t i = 0u; i < MAX_ENTITY_COUNT; ++i) {\n"
+    "\t\tw->parent[i] = NO_ENTITY;\n"
+    "\t\tw->firstChild[i] = NO_ENTITY;\n"
+    "\t}\n"
+    "\tatomic_init(&w->freeHead, FREE_LIST_END);\n"
+    + initEventsSector
+    + initGroupsSector
+    + initIndexesSector
+    + initSnapshotsSector +
+    "}\n"
+    "\n"
+    "// every world is independent, so different worlds can be stepped on different threads\n"
+    "world* world_create() {\n"
+    "\t// the id caches, event queues and snapshot counters sit on their own cache lines, calloc only aligns to 16.\n"
+    "\t// sizeof(world) is a multiple of its alignment, as aligned_alloc wants\n"
+    "\tworld* w = (world*)aligned_alloc(_Alignof(world), sizeof(world));\n"
+    "\tif (w == 0)\n"
+    "\t\treturn 0;\n"
+    "\tmemset(w, 0, sizeof(world));\n"
+    "\tworld_init(w);\n"
+    "\treturn w;\n"
+    "}\n"
+    "\n"
+    "void world_destroy(world* w) {\n"
+    "\tcleanup(w);\n"
+    "\tfree(w); // aligned_alloc memory goes back through free\n"
+    "}\n"
+    "\n"
+    + (options.shm ? generate_c_shared_world(layoutSector, viewSector) : string())
+    + eventsSector
+    + snapshotsSector +
+    "// call once per tick, drops the events nobody drained, the queues keep their memory,\n"
+    "// and publishes the snapshots of the buffered components\n"
+    "void world_end_tick(world* w) {\n"
+    "\t(void)w;\n"
+    + clearEventsSector
+    + publishSnapshotsSector +
+    "}\n"
+    "\n"
     + addComponentSector
     + getComponentSector;
 }
@@ -205,21 +1448,122 @@ string generate_c_destroy_some(const definition_info& definition) {
         }
     } else {
         cout << "invalid definition\n";
-        exit(1);
+        fail();
     }
 }
 
+// read counters of every component and match counters of every foreach, pgo_dump() writes them for --pgo-use.
+// The counters are extern so the inline accessors of a --header can reach them
+string generate_c_pgo(const vector<definition_info>& definitions, const generator_options& options) {
+    if (!options.pgoInstrument)
+        return "";
+    std::map<size_t, string> componentNames;
+    for (const auto& d : definitions) {
+        if (d.type == DEFINITION_TYPE_COMPONENT)
+            componentNames[std::stoul(d.opcode.at(1))] = d.opcode.at(0);
+    }
+    string namesSector;
+    for (const auto& name : componentNames)
+        namesSector += "\t\"" + name.second + "\",\n";
+
+    string queriesSector;
+    string pairsSector;
+    size_t queryCount = 0u;
+    size_t pairCount = 0u;
+    for (const auto& d : definitions) {
+        if (!is_query(d))
+            continue;
+        string components;
+        vector<string> dataComponents;
+        for (size_t ci = 1; ci < d.opcode.size(); ++ci) {
+            const auto& component = d.opcode[ci];
+            if ((component[0] == '!') || (component[0] == '?'))
+                continue;
+            components += (components.empty() ? string() : string(" ")) + component;
+            const definition_info* c = find_component(definitions, component);
+            if ((c != nullptr) && (c->type == DEFINITION_TYPE_COMPONENT))
+                dataComponents.emplace_back(component);
+        }
+        queriesSector += "\t\"" + components + "\",\n";
+        for (size_t a = 0u; a < dataComponents.size(); ++a) {
+            for (size_t b = a + 1u; b < dataComponents.size(); ++b) {
+                pairsSector += "\t{ \"" + dataComponents[a] + "\", \"" + dataComponents[b] + "\", " + to_string(queryCount) + "u },\n";
+                ++pairCount;
+            }
+        }
+        ++queryCount;
+    }
+    return
+    "#include <stdio.h>\n"
+    "#define PGO_QUERY_COUNT " + to_string(queryCount) + "\n"
+    "#define PGO_PAIR_COUNT " + to_string(pairCount) + "\n"
+    "typedef struct pgo_pair {\n"
+    "\tconst char* first;\n"
+    "\tconst char* second;\n"
+    "\tsize_t query; // both are required by this foreach\n"
+    "} pgo_pair;\n"
+    "extern _Atomic uint64_t pgoComponentReads[COMPONENT_COUNT + 1]; // get_ calls by component id\n"
+    "extern _Atomic uint64_t pgoQueryMatches[PGO_QUERY_COUNT + 1]; // matched entities by foreach, in schema order\n"
+    "_Atomic uint64_t pgoComponentReads[COMPONENT_COUNT + 1];\n"
+    "_Atomic uint64_t pgoQueryMatches[PGO_QUERY_COUNT + 1];\n"
+    "static const char* const pgoComponentNames[COMPONENT_COUNT + 1] = {\n"
+    + namesSector +
+    "\t0\n"
+    "};\n"
+    "// the components every foreach requires\n"
+    "static const char* const pgoQueries[PGO_QUERY_COUNT + 1] = {\n"
+    + queriesSector +
+    "\t0\n"
+    "};\n"
+    "static const pgo_pair pgoPairs[PGO_PAIR_COUNT + 1] = {\n"
+    + pairsSector +
+    "\t{ 0, 0, 0u }\n"
+    "};\n"
+    "\n"
+    "// writes `component NAME READS`, `query MATCHES COMPONENTS...` and `pair FIRST SECOND MATCHES` lines\n"
+    "// for ecs_gen --pgo-use, returns 0 on failure\n"
+    "int pgo_dump(const char* path) {\n"
+    "\tFILE* file = fopen(path, \"w\");\n"
+    "\tif (file == 0)\n"
+    "\t\treturn 0;\n"
+    "\tfor (size_t i = 0u; i < COMPONENT_COUNT; ++i)\n"
+    "\t\tfprintf(file, \"component %s %llu\\n\", pgoComponentNames[i], (unsigned long long)atomic_load(&pgoComponentReads[i]));\n"
+    "\t// the tables end at their sentinel, a bound of 0 would trip -Wtype-limits in schemas without foreach or pairs\n"
+    "\tfor (size_t i = 0u; pgoQueries[i] != 0; ++i)\n"
+    "\t\tfprintf(file, \"query %llu %s\\n\", (unsigned long long)atomic_load(&pgoQueryMatches[i]), pgoQueries[i]);\n"
+    "\tfor (const pgo_pair* pair = pgoPairs; pair->first != 0; ++pair)\n"
+    "\t\tfprintf(file, \"pair %s %s %llu\\n\", pair->first, pair->second, (unsigned long long)atomic_load(&pgoQueryMatches[pair->query]));\n"
+    "\treturn fclose(file) == 0;\n"
+    "}\n"
+    "\n";
+}
+
 string generate_c_structures(const vector<definition_info>& definitions) {
     string result;
     for (size_t i = 0; i < definitions.size(); ++i) {
         const definition_type definitionType = definitions[i].type;
-        if ((definitionType == DEFINITION_TYPE_COMPONENT) || (definitionType == DEFINITION_TYPE_STRUCT)) {
+        if (definitionType == DEFINITION_TYPE_GROUP) {
+            // the first count entries of every array belong to the same entities
+            const string name = group_name(definitions[i]);
+            result +=
+            "typedef struct " + name + "_group {\n"
+            "\tentity_t entities[MAX_ENTITY_COUNT];\n"
+            "\tsize_t index[MAX_ENTITY_COUNT]; // position of an entity in the arrays, (size_t)-1 if it is not in the group\n"
+            "\tsize_t count;\n";
+            for (const auto& component : definitions[i].opcode)
+                result += "\t" + component + " " + component + "Data[MAX_ENTITY_COUNT];\n";
+            result +=
+            "} " + name + "_group;\n";
+            continue;
+        }
+        if ((definitionType == DEFINITION_TYPE_COMPONENT) || (definitionType == DEFINITION_TYPE_STRUCT) || (definitionType == DEFINITION_TYPE_EVENT)) {
+            const size_t componentIndex = i;
             const auto& name = definitions[i].opcode.at(0);
             result += "typedef struct " + name + " {\n";
 
             string destroyMembersSector;
             ++i;
-            for (; (i < definitions.size()) && (definitionType == DEFINITION_TYPE_MEMBER); ++i) {
+            for (; (i < definitions.size()) && (definitions[i].type == DEFINITION_TYPE_MEMBER); ++i) {
                 const auto& typeName = definitions[i].opcode.at(0);
                 const auto& memberName = definitions[i].opcode.at(1);
                 result += "\t" + typeName + " " + memberName + ";\n";
@@ -233,6 +1577,30 @@ string generate_c_structures(const vector<definition_info>& definitions) {
             "\t(void)__w__;\n"
             + destroyMembersSector +
             "}\n";
+
+            if ((definitionType == DEFINITION_TYPE_COMPONENT) && is_buffered_component(definitions[componentIndex])) {
+                result +=
+                "typedef struct " + name + "_snapshot {\n"
+                "\tentity_t count; // ids at or above count were not alive when it was taken\n"
+                "\tunsigned char exist[MAX_ENTITY_COUNT];\n"
+                "\t" + name + " data[MAX_ENTITY_COUNT];\n"
+                "} " + name + "_snapshot;\n"
+                "const " + name + "* snapshot_" + name + "(const " + name + "_snapshot* snapshot, entity_t entity) {\n"
+                "\tif ((entity >= snapshot->count) || !snapshot->exist[entity])\n"
+                "\t\treturn 0;\n"
+                "\treturn &snapshot->data[entity];\n"
+                "}\n";
+            }
+            if (definitionType == DEFINITION_TYPE_EVENT) {
+                // bounded ring, every slot carries a sequence number so producers only race on enqueuePos
+                result +=
+                "typedef struct " + name + "_queue {\n"
+                "\t_Atomic size_t sequence[EVENT_QUEUE_CAPACITY];\n"
+                "\t" + name + " items[EVENT_QUEUE_CAPACITY];\n"
+                "\t_Alignas(64) _Atomic size_t enqueuePos;\n"
+                "\t_Alignas(64) size_t dequeuePos;\n"
+                "} " + name + "_queue;\n";
+            }
         }
     }
     return result;
@@ -241,7 +1609,9 @@ string generate_c_structures(const vector<definition_info>& definitions) {
 string generate_c_create_ent_with_name(const string& name) {
     return
     "// ent " + name + "\n"
-    "const entity_t " + name + " = create();\n";
+    "const entity_t " + name + " = create(__world__);\n"
+    "if (" + name + " == NO_ENTITY)\n"
+    "\tabort(); // the world is full, the adds below would write past the component arrays\n";
 }
 
 string generate_c_add_coponents(const definition_info& addDefinition, const vector<definition_info>& definitions) {
@@ -252,20 +1622,15 @@ string generate_c_add_coponents(const definition_info& addDefinition, const vect
         const auto& componentName = addDefinition.opcode[j];
         bool found = false;
 
-        for (const auto& i : definitions) {
-            if ((i.type == DEFINITION_TYPE_COMPONENT) && (i.opcode.at(0) == componentName)) {
-                found = true;
-                const auto& name = i.opcode.at(0);
-                const auto& strComponentID = i.opcode.at(1);
-                result +=
-                "// add first " + componentName + "\n"
-                "add_" + componentName +"(" + entityName + ");\n";
-                break;
-            }
+        if (find_component(definitions, componentName) != nullptr) {
+            found = true;
+            result +=
+            "// add first " + componentName + "\n"
+            "add_" + componentName +"(__world__, " + entityName + ");\n";
         }
         if (!found) {
             cout << "component not found\n";
-            exit(1);
+            fail();
         }
     }
 
@@ -276,40 +1641,213 @@ string generate_c_add_coponents(const definition_info& addDefinition, const vect
 string generate_c_destroy_entity(const string& name) {
     return
     "// destroy " + name + "\n"
-    "destroy_entity(" + name + ");\n";
+    "destroy_entity(__world__, " + name + ");\n";
+}
+
+string generate_c_destroy_all(const definition_info& destroyAllDefinition, const vector<definition_info>& definitions) {
+    vector<string> components;
+    vector<string> tags;
+    string comment;
+    for (const auto& name : destroyAllDefinition.opcode) {
+        const definition_info* d = find_component(definitions, name);
+        if (d == nullptr) {
+            cout << "component not found\n";
+            fail();
+        }
+        (d->type == DEFINITION_TYPE_COMPONENT ? components : tags).emplace_back(name);
+        comment += " " + name;
+    }
+    return
+    "// destroy_all" + comment + "\n"
+    "{\n"
+    + (components.empty() ? string() : "\tconst uint64_t components[COMPONENT_MASK_WORDS] = " + generate_c_mask_initializer(mask_words(definitions, components, DEFINITION_TYPE_COMPONENT)) + ";\n")
+    + (tags.empty() ? string() : "\tconst uint64_t tags[TAG_MASK_WORDS] = " + generate_c_mask_initializer(mask_words(definitions, tags, DEFINITION_TYPE_TAG_COMPONENT)) + ";\n") +
+    "\tdestroy_all(__world__, " + (components.empty() ? string("0") : string("components")) + ", " + (tags.empty() ? string("0") : string("tags")) + ");\n"
+    "}\n";
 }
 
 string generate_c_program_exit() {
     return
     "// program exit\n"
-    "cleanup();\n";
+    "world_destroy(__world__);\n";
 }
 
-string generate_c_foreach(const definition_info& foreachDefinition, const vector<definition_info>& definitions) {
+// required bits set and excluded bits clear, one masked compare per word of componentMask and tagMask.
+// optional components don't take part in matching. alive: the driver only yields live entities
+string generate_c_foreach_condition(const definition_info& foreachDefinition, const vector<definition_info>& definitions, bool alive = false) {
     const auto& iteratorName = foreachDefinition.opcode.at(0);
-    if (foreachDefinition.opcode.size() < 2) {
-        return
-        "// foreach " + iteratorName + " [components] { your shitty(my) code }\n"
-        "for (entity_t " + iteratorName + " = 0u; " + iteratorName + " < max_id; ++" + iteratorName + ")\n"
-        "\tif (existMask[" + iteratorName + "]) ";
+    vector<string> required;
+    vector<string> excluded;
+    for (size_t ci = 1; ci < foreachDefinition.opcode.size(); ++ci) {
+        const auto& component = foreachDefinition.opcode[ci];
+        if (component[0] == '!')
+            excluded.emplace_back(component.substr(1));
+        else if (component[0] != '?')
+            required.emplace_back(component);
     }
+
     string checkSector;
+    bool anyRequired = false;
+    for (const definition_type type : { DEFINITION_TYPE_COMPONENT, DEFINITION_TYPE_TAG_COMPONENT }) {
+        const string mask = (type == DEFINITION_TYPE_COMPONENT) ? "componentMask" : "tagMask";
+        const vector<uint64_t> requiredWords = mask_words(definitions, required, type);
+        const vector<uint64_t> excludedWords = mask_words(definitions, excluded, type);
+        for (size_t word = 0u; word < requiredWords.size(); ++word) {
+            if ((requiredWords[word] | excludedWords[word]) == 0u)
+                continue;
+            anyRequired = anyRequired || (requiredWords[word] != 0u);
+            checkSector +=
+            (checkSector.empty() ? string() : string(" && "))
+            + "((__world__->" + mask + "[" + iteratorName + "][" + to_string(word) + "] & " + generate_c_mask_word(requiredWords[word] | excludedWords[word]) + ") == "
+            + generate_c_mask_word(requiredWords[word]) + ")";
+        }
+    }
+    if (!anyRequired && !(alive && !checkSector.empty()))
+        checkSector = "__world__->existMask[" + iteratorName + "]" + (checkSector.empty() ? string() : " && " + checkSector);
+    return checkSector;
+}
+
+// the loop condition already proved presence, so the pointers are loaded once and never checked,
+// optional ones are 0 when the component is missing. Components of the driving group are taken straight from its dense arrays
+string generate_c_foreach_bindings(const definition_info& foreachDefinition, const vector<definition_info>& definitions, const definition_info* groupDefinition) {
+    const auto& iteratorName = foreachDefinition.opcode.at(0);
+    string result;
+    for (const auto& binding : bindings_of(definitions, foreachDefinition)) {
+        const auto& component = binding.opcode.at(0);
+        const auto& name = binding.opcode.at(1);
+        const bool grouped = (groupDefinition != nullptr) && (std::find(groupDefinition->opcode.begin(), groupDefinition->opcode.end(), component) != groupDefinition->opcode.end());
+        const string slot = "__world__->componentsData[" + find_component(definitions, component)->opcode.at(1) + "][" + iteratorName + "]";
+        // every component lives in its own buffer or group array, bound pointers never alias
+        result +=
+        component + "* restrict const " + name + " = "
+        + (grouped
+            ? "&__world__->" + group_name(*groupDefinition) + "Group." + component + "Data[" + iteratorName + "__index];\n"
+            : is_optional_binding(binding)
+                ? slot + ".exist ? (" + component + "*)" + slot + ".data : 0;\n"
+                : "(" + component + "*)" + slot + ".data;\n") +
+        "(void)" + name + ";\n";
+    }
+    return result;
+}
+
+// the biggest group whose components are all required by the foreach, nullptr if there is none.
+// Excluded and optional components never drive
+const definition_info* find_driving_group(const definition_info& foreachDefinition, const vector<definition_info>& definitions) {
+    const definition_info* best = nullptr;
+    for (const auto& d : definitions) {
+        if (d.type != DEFINITION_TYPE_GROUP)
+            continue;
+        const bool covered = std::all_of(d.opcode.begin(), d.opcode.end(), [&foreachDefinition](const string& component) {
+            return std::find(foreachDefinition.opcode.begin() + 1, foreachDefinition.opcode.end(), component) != foreachDefinition.opcode.end();
+        });
+        if (covered && ((best == nullptr) || (d.opcode.size() > best->opcode.size())))
+            best = &d;
+    }
+    return best;
+}
+
+// walks the dense arrays of the group, only components outside of it and excluded ones are checked
+string generate_c_foreach_group(const definition_info& foreachDefinition, const definition_info& groupDefinition, const vector<definition_info>& definitions, const generator_options& options, string& bodyPrologue) {
+    const auto& iteratorName = foreachDefinition.opcode.at(0);
+    const string indexName = iteratorName + "__index";
+    const string group = "__world__->" + group_name(groupDefinition) + "Group";
+
+    definition_info rest{.type = foreachDefinition.type, .opcode = { iteratorName }};
     for (size_t ci = 1; ci < foreachDefinition.opcode.size(); ++ci) {
         const auto& component = foreachDefinition.opcode[ci];
+        if ((component[0] != '?') && (std::find(groupDefinition.opcode.begin(), groupDefinition.opcode.end(), component) == groupDefinition.opcode.end()))
+            rest.opcode.emplace_back(component);
+    }
 
-        for (const auto& d : definitions) {
-            if ((d.type == DEFINITION_TYPE_COMPONENT) && (component == d.opcode.at(0))) {
-                const string strComponentID = d.opcode.at(1);
-                checkSector += "componentsData[" + strComponentID + "][" + iteratorName + "].exist" + (ci == (foreachDefinition.opcode.size() - 1) ? string("") : string(" && "));
-                break;
-            }
-        }
+    bodyPrologue =
+    "const entity_t " + iteratorName + " = " + group + ".entities[" + indexName + "];\n"
+    "(void)" + iteratorName + ";\n"
+    + (options.profile ? string("++profilerVisited;\n") : string());
+    if (rest.opcode.size() > 1) {
+        bodyPrologue +=
+        "if (!(" + generate_c_foreach_condition(rest, definitions, true) + "))\n"
+        "\tcontinue;\n";
     }
+    if (options.profile)
+        bodyPrologue += "++profilerMatched;\n";
+    bodyPrologue += generate_c_foreach_bindings(foreachDefinition, definitions, &groupDefinition);
+    return
+    // backwards, destroying the current entity moves an already visited one into its place
+    "// foreach " + iteratorName + " [components] { your shitty(my) code }, driven by group " + group_name(groupDefinition) + "\n"
+    "for (size_t " + indexName + " = " + group + ".count; " + indexName + "-- > 0u; ) ";
+}
 
+// max_id is read once, entities created by the body are not visited
+string generate_c_foreach(const definition_info& foreachDefinition, const vector<definition_info>& definitions, const generator_options& options, string& bodyPrologue) {
+    const auto& iteratorName = foreachDefinition.opcode.at(0);
+    const definition_info* group = find_driving_group(foreachDefinition, definitions);
+    if (group != nullptr)
+        return generate_c_foreach_group(foreachDefinition, *group, definitions, options, bodyPrologue);
+    if (options.profile)
+        bodyPrologue = "++profilerMatched;\n";
+    bodyPrologue += generate_c_foreach_bindings(foreachDefinition, definitions, nullptr);
     return
     "// foreach " + iteratorName + " [components] { your shitty(my) code }\n"
-    "for (entity_t " + iteratorName + " = 0u; " + iteratorName + " < max_id; ++" + iteratorName + ")\n"
-    "\tif (" + checkSector + ") ";
+    "for (entity_t " + iteratorName + " = 0u, " + iteratorName + "__end = atomic_load_explicit(&__world__->max_id, memory_order_relaxed); " + iteratorName + " < " + iteratorName + "__end; ++" + iteratorName + ")\n"
+    "\tif (" + (options.profile ? string("++profilerVisited, ") : string()) + generate_c_foreach_condition(foreachDefinition, definitions) + ") ";
+}
+
+// parents are visited before their children, the entity is bound at the start of the body.
+// Only the visit order is sorted by depth, the component data stays in the slots of the entities.
+// Ids above hierarchyCount were created after the last rebuild, they are roots and come last
+string generate_c_foreach_hierarchy(const definition_info& foreachDefinition, const vector<definition_info>& definitions, const generator_options& options, string& bodyPrologue) {
+    const auto& iteratorName = foreachDefinition.opcode.at(0);
+    const string indexName = iteratorName + "__index";
+    bodyPrologue =
+    "const entity_t " + iteratorName + " = (" + indexName + " < __world__->hierarchyCount) ? __world__->hierarchyOrder[" + indexName + "] : (entity_t)" + indexName + ";\n"
+    + (options.profile ? string("++profilerVisited;\n") : string()) +
+    "if (!(" + generate_c_foreach_condition(foreachDefinition, definitions) + "))\n"
+    "\tcontinue;\n"
+    + (options.profile ? string("++profilerMatched;\n") : string())
+    + generate_c_foreach_bindings(foreachDefinition, definitions, nullptr);
+    return
+    "// foreach_hierarchy " + iteratorName + " [components] { code }\n"
+    "hierarchy_update(__world__);\n"
+    "for (size_t " + indexName + " = 0u, " + iteratorName + "__end = atomic_load_explicit(&__world__->max_id, memory_order_relaxed); " + indexName + " < " + iteratorName + "__end; ++" + indexName + ") ";
+}
+
+// drains the events that were fully pushed when the loop started, in one batch
+string generate_c_foreach_event(const definition_info& foreachDefinition, const generator_options& options, string& bodyPrologue, string& bodyEpilogue) {
+    const auto& iteratorName = foreachDefinition.opcode.at(0);
+    const auto& eventName = foreachDefinition.opcode.at(1);
+    const string indexName = iteratorName + "__index";
+    const string countName = iteratorName + "__count";
+    const string queue = "__world__->" + eventName + "Events";
+    bodyPrologue =
+    eventName + "* const " + iteratorName + " = &" + queue + ".items[(" + queue + ".dequeuePos + " + indexName + ") & (EVENT_QUEUE_CAPACITY - 1u)];\n"
+    "(void)" + iteratorName + ";\n"
+    + (options.profile ? string("++profilerVisited;\n++profilerMatched;\n") : string());
+    bodyEpilogue =
+    "end_drain_" + eventName + "(__world__, " + countName + ");\n"
+    "}\n";
+    return
+    "// foreach_event " + iteratorName + " " + eventName + " { code }\n"
+    "{\n"
+    "const size_t " + countName + " = begin_drain_" + eventName + "(__world__);\n"
+    "for (size_t " + indexName + " = 0u; " + indexName + " < " + countName + "; ++" + indexName + ") ";
+}
+
+// opens a block with a timed scope, the matching epilogue closes it
+string generate_c_profile_begin(const string& scopeName, string& bodyEpilogue) {
+    bodyEpilogue +=
+    "profiler_end(&__profile__);\n"
+    "}\n";
+    return
+    "{\n"
+    "profiler_scope __profile__ = profiler_begin(\"" + scopeName + "\");\n";
+}
+
+string generate_c_set_parent(const definition_info& definition) {
+    const auto& childName = definition.opcode.at(0);
+    const auto& parentName = definition.opcode.at(1);
+    return
+    "// " + childName + " parent " + parentName + "\n"
+    "set_parent(__world__, " + childName + ", " + parentName + ");\n";
 }
 
 template<class IterT>
@@ -318,27 +1856,96 @@ IterT parse_function(IterT begin, IterT end, vector<variable_info>& variableCont
     for (; (ii != end) && (ii->type() != sxt::STX_TOKEN_TYPE_RCURLY) && (ii->type() != sxt::STX_TOKEN_TYPE_SEMICOLON); ++ii) {
         if (ii->type() == sxt::STX_TOKEN_TYPE_WORD) {
             if (ii->value() == "ent") {
-                ii = predict_next(ii, sxt::STX_TOKEN_TYPE_WORD, [](){exit(1);});
+                ii = predict_next(ii, sxt::STX_TOKEN_TYPE_WORD, [](){fail();});
 
                 const auto& name = ii->value();
                 definitions.emplace_back(definition_info{.type = DEFINITION_TYPE_CREATE, .opcode = { name }});
                 variableContext.emplace_back(variable_info{.typeName = "ent", .name = name});
 
-                ii = predict_next(ii, sxt::STX_TOKEN_TYPE_SEMICOLON, [](){exit(1);});
-            } else if (ii->value() == "foreach") {
-                ii = predict_next(ii, sxt::STX_TOKEN_TYPE_WORD, [](){exit(1);});
+                ii = predict_next(ii, sxt::STX_TOKEN_TYPE_SEMICOLON, [](){fail();});
+            } else if (ii->value() == "destroy_all") {
+                definitions.emplace_back(definition_info{.type = DEFINITION_TYPE_DESTROY_ALL, .opcode = { }});
+                definition_info& destroyAllDefinition = definitions.back();
+                for (++ii; (ii != end) && (ii->type() != sxt::STX_TOKEN_TYPE_SEMICOLON); ++ii)
+                    destroyAllDefinition.opcode.emplace_back(ii->value());
+                if (ii == end)
+                    ERROR_REPORT("EOF while parsing 'destroy_all'\n");
+            } else if ((ii->value() == "foreach") || (ii->value() == "foreach_hierarchy") || (ii->value() == "foreach_event")) {
+                const definition_type cycleType =
+                    (ii->value() == "foreach") ? DEFINITION_TYPE_FOREACH_CYCLE :
+                    (ii->value() == "foreach_hierarchy") ? DEFINITION_TYPE_FOREACH_HIERARCHY : DEFINITION_TYPE_FOREACH_EVENT;
+                ii = predict_next(ii, sxt::STX_TOKEN_TYPE_WORD, [](){fail();});
 
                 const auto& iteratorName = ii->value();
-                definitions.emplace_back(definition_info{.type = DEFINITION_TYPE_FOREACH_CYCLE, .opcode = { iteratorName }});
+                definitions.emplace_back(definition_info{.type = cycleType, .opcode = { iteratorName }});
 
                 definition_info& foreachDefinition = definitions.back();
                 variableContext.emplace_back(variable_info{.typeName = "ent", .name = iteratorName});
 
+                vector<definition_info> bindings;
                 ++ii;
-                for (; (ii != end) && (ii->type() != sxt::STX_TOKEN_TYPE_LCURLY); ++ii)
-                    foreachDefinition.opcode.emplace_back(ii->value());
+                for (; (ii != end) && (ii->type() != sxt::STX_TOKEN_TYPE_LCURLY); ++ii) {
+                    if ((ii->type() == sxt::STX_TOKEN_TYPE_EXCLAMATION) || (ii->type() == sxt::STX_TOKEN_TYPE_QUESTION)) {
+                        // !component skips entities that have it, ?component doesn't filter
+                        const string filter = ii->value();
+                        ii = predict_next(ii, sxt::STX_TOKEN_TYPE_WORD, [](){fail();});
+                        if (find_component(definitions, ii->value()) == nullptr)
+                            ERROR_REPORT("unknown component in foreach filter: " + ii->value() + "\n");
+                        foreachDefinition.opcode.emplace_back(filter + ii->value());
+                        continue;
+                    }
+                    if (ii->type() != sxt::STX_TOKEN_TYPE_LPAREN) {
+                        foreachDefinition.opcode.emplace_back(ii->value());
+                        continue;
+                    }
+                    // (component* name, ...) requires the components and binds their data,
+                    // (?component* name) binds a pointer that is 0 when the component is missing
+                    do {
+                        const bool optional = (std::next(ii) != end) && (std::next(ii)->type() == sxt::STX_TOKEN_TYPE_QUESTION);
+                        if (optional)
+                            ++ii;
+                        ii = predict_next(ii, sxt::STX_TOKEN_TYPE_WORD, [](){fail();});
+                        const auto& component = ii->value();
+                        ii = predict_next(ii, sxt::STX_TOKEN_TYPE_STAR, [](){fail();});
+                        ii = predict_next(ii, sxt::STX_TOKEN_TYPE_WORD, [](){fail();});
+                        const definition_info* d = find_component(definitions, component);
+                        if ((d == nullptr) || (d->type != DEFINITION_TYPE_COMPONENT))
+                            ERROR_REPORT("only data components can be bound: " + component + "\n");
+                        for (const auto& binding : bindings) {
+                            if (binding.opcode.at(0) == component)
+                                ERROR_REPORT("component bound twice: " + component + "\n");
+                        }
+                        bindings.emplace_back(definition_info{.type = DEFINITION_TYPE_BINDING, .opcode = { component, ii->value() }});
+                        if (optional)
+                            bindings.back().opcode.emplace_back("optional");
+                        foreachDefinition.opcode.emplace_back((optional ? string("?") : string()) + component);
+                        ++ii;
+                    } while ((ii != end) && (ii->type() == sxt::STX_TOKEN_TYPE_COMMA));
+                    if ((ii == end) || (ii->type() != sxt::STX_TOKEN_TYPE_RPAREN))
+                        ERROR_REPORT("invalid foreach bindings syntax\n");
+                }
+                for (size_t ci = 1; ci < foreachDefinition.opcode.size(); ++ci) {
+                    const auto& component = foreachDefinition.opcode[ci];
+                    const bool filtered = (component[0] == '!') || (component[0] == '?');
+                    if (filtered && (cycleType == DEFINITION_TYPE_FOREACH_EVENT))
+                        ERROR_REPORT("foreach_event can't filter components\n");
+                    if (filtered && (std::find(foreachDefinition.opcode.begin() + 1, foreachDefinition.opcode.end(), component.substr(1)) != foreachDefinition.opcode.end()))
+                        ERROR_REPORT(component.substr(1) + " is required and filtered by the same foreach\n");
+                }
+                if ((cycleType == DEFINITION_TYPE_FOREACH_EVENT) && !bindings.empty())
+                    ERROR_REPORT("foreach_event binds its event already\n");
+                if (cycleType == DEFINITION_TYPE_FOREACH_EVENT) {
+                    const bool isEvent = (foreachDefinition.opcode.size() == 2) && std::any_of(definitions.begin(), definitions.end(),
+                        [&foreachDefinition](const definition_info& d) {
+                            return (d.type == DEFINITION_TYPE_EVENT) && (d.opcode.at(0) == foreachDefinition.opcode.at(1));
+                        });
+                    if (!isEvent)
+                        ERROR_REPORT("foreach_event expects exactly one event name\n");
+                    variableContext.back().typeName = foreachDefinition.opcode.at(1);
+                }
                 ++ii;
 
+                definitions.insert(definitions.end(), bindings.begin(), bindings.end());
                 definitions.emplace_back(definition_info{.type = DEFINITION_TYPE_BODY_BEGIN, .opcode = { }});
                 ii = parse_function(ii, end, variableContext, definitions);
                 definitions.emplace_back(definition_info{.type = DEFINITION_TYPE_BODY_END, .opcode = { }});
@@ -354,12 +1961,12 @@ IterT parse_function(IterT begin, IterT end, vector<variable_info>& variableCont
 
                 const variable_info& variable = *maybeVariable;
                 if (variable.typeName == "ent") {
-                    ii = predict_next(ii, sxt::STX_TOKEN_TYPE_DOT, [](){exit(1);});
-                    ii = predict_next(ii, sxt::STX_TOKEN_TYPE_WORD, [](){exit(1);});
+                    ii = predict_next(ii, sxt::STX_TOKEN_TYPE_DOT, [](){fail();});
+                    ii = predict_next(ii, sxt::STX_TOKEN_TYPE_WORD, [](){fail();});
                     const auto& methodName = *ii;
                     if (methodName.value() == "add") {
-                        ii = predict_next(ii, sxt::STX_TOKEN_TYPE_LESS, [](){exit(1);});
-                        ii = predict_next(ii, sxt::STX_TOKEN_TYPE_WORD, [](){exit(1);});
+                        ii = predict_next(ii, sxt::STX_TOKEN_TYPE_LESS, [](){fail();});
+                        ii = predict_next(ii, sxt::STX_TOKEN_TYPE_WORD, [](){fail();});
 
                         definitions.emplace_back(definition_info{.type = DEFINITION_TYPE_ADD_COMPONENTS, .opcode = { variable.name }});
                         definition_info& addComponentDefinition = definitions.back();
@@ -371,8 +1978,8 @@ IterT parse_function(IterT begin, IterT end, vector<variable_info>& variableCont
                             ++ii;
 
                             if (ii->type() == sxt::STX_TOKEN_TYPE_MORE) {
-                                ii = predict_next(ii, sxt::STX_TOKEN_TYPE_LPAREN, [](){exit(1);});
-                                ii = predict_next(ii, sxt::STX_TOKEN_TYPE_RPAREN, [](){exit(1);});
+                                ii = predict_next(ii, sxt::STX_TOKEN_TYPE_LPAREN, [](){fail();});
+                                ii = predict_next(ii, sxt::STX_TOKEN_TYPE_RPAREN, [](){fail();});
                                 break;
                             } else if (ii->type() == sxt::STX_TOKEN_TYPE_COMMA) {
                                 continue;
@@ -381,11 +1988,23 @@ IterT parse_function(IterT begin, IterT end, vector<variable_info>& variableCont
                             }
                         }
                     } else if (methodName.value() == "destroy") {
-                        ii = predict_next(ii, sxt::STX_TOKEN_TYPE_LPAREN, [](){exit(1);});
-                        ii = predict_next(ii, sxt::STX_TOKEN_TYPE_RPAREN, [](){exit(1);});
+                        ii = predict_next(ii, sxt::STX_TOKEN_TYPE_LPAREN, [](){fail();});
+                        ii = predict_next(ii, sxt::STX_TOKEN_TYPE_RPAREN, [](){fail();});
                         definitions.emplace_back(definition_info{.type = DEFINITION_TYPE_DESTROY_ENTITY, .opcode = { variable.name }});
+                    } else if (methodName.value() == "parent") {
+                        ii = predict_next(ii, sxt::STX_TOKEN_TYPE_LPAREN, [](){fail();});
+                        ii = predict_next(ii, sxt::STX_TOKEN_TYPE_WORD, [](){fail();});
+                        const auto maybeParent = find_pred(variableContext.begin(), variableContext.end(), ii->value(),
+                            [](const variable_info& info1, const string& name) {
+                                return info1.name == name;
+                            });
+                        if ((maybeParent == variableContext.end()) || (maybeParent->typeName != "ent"))
+                            ERROR_REPORT("unknown entity name: " + ii->value() + "\n");
+
+                        definitions.emplace_back(definition_info{.type = DEFINITION_TYPE_SET_PARENT, .opcode = { variable.name, maybeParent->name }});
+                        ii = predict_next(ii, sxt::STX_TOKEN_TYPE_RPAREN, [](){fail();});
                     }
-                    ii = predict_next(ii, sxt::STX_TOKEN_TYPE_SEMICOLON, [](){exit(1);});
+                    ii = predict_next(ii, sxt::STX_TOKEN_TYPE_SEMICOLON, [](){fail();});
                 }
             }
         } else if (ii->type() == sxt::STX_TOKEN_TYPE_LCURLY) {
@@ -398,13 +2017,17 @@ IterT parse_function(IterT begin, IterT end, vector<variable_info>& variableCont
 }
 
 void parse_definitions(const string& data, vector<definition_info>& definitions) {
+    // line and column are resolved only when an error is reported
+    errorSource = &data;
     sxt::tokenizer<string> tokenizer(data.begin(), data.end());
-    vector<sxt::position_token<string>> tokens;
-    for (sxt::position_token<string> current = tokenizer.next_position_token(sxt::STX_EXT_TOKEN_TYPE_FLAG_BIT_NONE); current.is_valid(); current = tokenizer.next_position_token(sxt::STX_EXT_TOKEN_TYPE_FLAG_BIT_NONE)) {
-        tokens.emplace_back(current);
+    vector<sxt::offset_token<string>> tokens;
+    for (sxt::offset_token<string> current = tokenizer.next_offset_token(sxt::STX_EXT_TOKEN_TYPE_FLAG_BIT_NONE); current.is_valid(); current = tokenizer.next_offset_token(sxt::STX_EXT_TOKEN_TYPE_FLAG_BIT_NONE)) {
+        tokens.emplace_back(SXT_MOVE(current));
     }
 
     size_t componentCount = 0u;
+    size_t tagCount = 0u;
+    size_t openDefinition = 0u; // index of the component or struct whose members are being parsed
 
     enum {
         EXPECTED_TYPE_DEFINITION,
@@ -416,44 +2039,71 @@ void parse_definitions(const string& data, vector<definition_info>& definitions)
     for (auto ii = tokens.begin(); ii != tokens.end(); ) {
         if (expected_type == EXPECTED_TYPE_DEFINITION) {
             if (ii->type() == sxt::STX_TOKEN_TYPE_WORD) {
+                const bool buffered = (ii->value() == "buffered");
+                if (buffered) {
+                    ii = predict_next(ii, sxt::STX_TOKEN_TYPE_WORD, [](){fail();});
+                    if (ii->value() != "component")
+                        ERROR_REPORT("only components can be buffered\n");
+                }
                 if (ii->value() == "component") {
-                    ii = predict_next(ii, sxt::STX_TOKEN_TYPE_WORD, [](){exit(1);});
+                    ii = predict_next(ii, sxt::STX_TOKEN_TYPE_WORD, [](){fail();});
                     const auto& name = ii->value();
+                    openDefinition = definitions.size();
                     definitions.emplace_back(definition_info{.type = DEFINITION_TYPE_COMPONENT, .opcode = { name, to_string(componentCount) }});
+                    if (buffered)
+                        definitions.back().opcode.emplace_back("buffered");
                     ++componentCount;
-                    ii = predict_next(ii, sxt::STX_TOKEN_TYPE_LCURLY, [](){exit(1);});
+                    ii = predict_next(ii, sxt::STX_TOKEN_TYPE_LCURLY, [](){fail();});
                     ++ii;
 
                     expected_type = EXPECTED_TYPE_COMPONENT_MEMBER_DEFINITION_TYPE;
                     continue;
-                } else if (ii->value() == "struct") {
-                    ii = predict_next(ii, sxt::STX_TOKEN_TYPE_WORD, [](){exit(1);});
+                } else if ((ii->value() == "struct") || (ii->value() == "event")) {
+                    const definition_type structType = (ii->value() == "struct") ? DEFINITION_TYPE_STRUCT : DEFINITION_TYPE_EVENT;
+                    ii = predict_next(ii, sxt::STX_TOKEN_TYPE_WORD, [](){fail();});
                     const auto& name = ii->value();
-                    definitions.emplace_back(definition_info{.type = DEFINITION_TYPE_STRUCT, .opcode = { name }});
-                    ii = predict_next(ii, sxt::STX_TOKEN_TYPE_LCURLY, [](){exit(1);});
+                    openDefinition = definitions.size();
+                    definitions.emplace_back(definition_info{.type = structType, .opcode = { name }});
+                    ii = predict_next(ii, sxt::STX_TOKEN_TYPE_LCURLY, [](){fail();});
                     ++ii;
 
                     expected_type = EXPECTED_TYPE_COMPONENT_MEMBER_DEFINITION_TYPE;
                     continue;
+                } else if (ii->value() == "group") {
+                    definitions.emplace_back(definition_info{.type = DEFINITION_TYPE_GROUP, .opcode = { }});
+                    for (++ii; (ii != tokens.end()) && (ii->type() == sxt::STX_TOKEN_TYPE_WORD); ++ii) {
+                        const definition_info* component = find_component(definitions, ii->value());
+                        if ((component == nullptr) || (component->type != DEFINITION_TYPE_COMPONENT))
+                            ERROR_REPORT("a group owns declared components with members only: " + ii->value() + "\n");
+                        if (find_owning_group(definitions, ii->value()) != nullptr)
+                            ERROR_REPORT(ii->value() + " is already owned by a group\n");
+                        definitions.back().opcode.emplace_back(ii->value());
+                    }
+                    if (ii == tokens.end())
+                        fail();
+                    if ((ii->type() != sxt::STX_TOKEN_TYPE_SEMICOLON) || definitions.back().opcode.empty())
+                        ERROR_REPORT("invalid group syntax, expected `group components...;`\n");
+                    ++ii;
+                    continue;
                 } else {
-                    exit(1);
+                    fail();
                 }
             } else if (ii->type() == sxt::STX_TOKEN_TYPE_TILDA) {
-                ii = predict_next(ii, sxt::STX_TOKEN_TYPE_WORD, [](){exit(1);});
+                ii = predict_next(ii, sxt::STX_TOKEN_TYPE_WORD, [](){fail();});
                 const auto& returnTypename = ii->value();
-                ii = predict_next(ii, sxt::STX_TOKEN_TYPE_WORD, [](){exit(1);});
+                ii = predict_next(ii, sxt::STX_TOKEN_TYPE_WORD, [](){fail();});
                 const auto& name = ii->value();
 
 
                 definitions.emplace_back(definition_info{.type = DEFINITION_TYPE_FUNCTION, .opcode = { returnTypename, name } });
 
-                ii = predict_next(ii, sxt::STX_TOKEN_TYPE_LPAREN, [](){exit(1);});
+                ii = predict_next(ii, sxt::STX_TOKEN_TYPE_LPAREN, [](){fail();});
 
                 // arguments parse here, TODO
 
-                ii = predict_next(ii, sxt::STX_TOKEN_TYPE_RPAREN, [](){exit(1);});
+                ii = predict_next(ii, sxt::STX_TOKEN_TYPE_RPAREN, [](){fail();});
 
-                // ii = predict_next(ii, sxt::STX_TOKEN_TYPE_LCURLY, [](){exit(1);});
+                // ii = predict_next(ii, sxt::STX_TOKEN_TYPE_LCURLY, [](){fail();});
                 // ii = parse_function(ii, tokens.end(), variableContext, definitions);
                 // definitions.emplace_back(definition_info{.type = DEFINITION_TYPE_BODY_END, .opcode = { } });
                 // ++ii;
@@ -476,19 +2126,37 @@ void parse_definitions(const string& data, vector<definition_info>& definitions)
             }
         } else if (expected_type == EXPECTED_TYPE_COMPONENT_MEMBER_DEFINITION_TYPE) {
             if (ii->type() == sxt::STX_TOKEN_TYPE_WORD)  {
+                const bool indexed = (ii->value() == "indexed");
+                if (indexed) {
+                    if (definitions[openDefinition].type != DEFINITION_TYPE_COMPONENT)
+                        ERROR_REPORT("only component members can be indexed\n");
+                    ii = predict_next(ii, sxt::STX_TOKEN_TYPE_WORD, [](){fail();});
+                }
                 const auto& memberTypename = ii->value();
-                ii = predict_next(ii, sxt::STX_TOKEN_TYPE_WORD, [](){exit(1);});
+                ii = predict_next(ii, sxt::STX_TOKEN_TYPE_WORD, [](){fail();});
                 const auto& memberName =  ii->value();
-                ii = predict_next(ii, sxt::STX_TOKEN_TYPE_SEMICOLON, [](){exit(1);});
+                ii = predict_next(ii, sxt::STX_TOKEN_TYPE_SEMICOLON, [](){fail();});
 
                 definitions.emplace_back(definition_info{.type = DEFINITION_TYPE_MEMBER, .opcode = { memberTypename, memberName }});
+                if (indexed)
+                    definitions.back().opcode.emplace_back("indexed");
                 ++ii;
 
                 expected_type = EXPECTED_TYPE_COMPONENT_MEMBER_DEFINITION_TYPE;
 
                 continue;
             } else if (ii->type() == sxt::STX_TOKEN_TYPE_RCURLY) {
-                ii = predict_next(ii, sxt::STX_TOKEN_TYPE_SEMICOLON, [](){exit(1);});
+                definition_info& component = definitions[openDefinition];
+                if ((component.type == DEFINITION_TYPE_COMPONENT) && (openDefinition == (definitions.size() - 1))) {
+                    if (is_buffered_component(component))
+                        ERROR_REPORT("a buffered component needs members: " + component.opcode.at(0) + "\n");
+                    // member-less component, store it as a bit only
+                    component.type = DEFINITION_TYPE_TAG_COMPONENT;
+                    component.opcode.at(1) = to_string(tagCount);
+                    ++tagCount;
+                    --componentCount;
+                }
+                ii = predict_next(ii, sxt::STX_TOKEN_TYPE_SEMICOLON, [](){fail();});
                 ++ii;
                 expected_type = EXPECTED_TYPE_DEFINITION;
 
@@ -501,32 +2169,94 @@ void parse_definitions(const string& data, vector<definition_info>& definitions)
     definitions.emplace_back(definition_info{.type = DEFINITION_TYPE_EOF, .opcode = {}}); // eof
 }
 
-string generate_c_functions(const vector<definition_info>& definitions) {
+string generate_c_functions(const vector<definition_info>& definitions, const generator_options& options) {
     string result;
     bool inFunction = false;
+    bool inMain = false;
+    string functionName;
+    size_t depth = 0u;
+    string bodyPrologue;
+    string bodyEpilogue;
+    vector<string> epilogues; // emitted after the closing brace of every open body
     for (size_t i = 0u; i < definitions.size(); ++i) {
         const definition_info& definition = definitions[i];
 
         if (definition.type == DEFINITION_TYPE_BODY_BEGIN) {
             result += "{\n";
+            if ((depth == 0u) && inMain)
+                result += "world* __world__ = world_create();\n";
+            if ((depth == 0u) && options.profile)
+                result += "profiler_scope __profile__ = profiler_begin(\"" + functionName + "\");\n";
+            result += bodyPrologue;
+            bodyPrologue.clear();
+            epilogues.emplace_back(bodyEpilogue);
+            bodyEpilogue.clear();
+            ++depth;
         } else if (definition.type == DEFINITION_TYPE_BODY_END) {
+            --depth;
+            if ((depth == 0u) && options.profile)
+                result += "profiler_end(&__profile__);\n";
+            if ((depth == 0u) && inMain && options.profile)
+                result += "profiler_dump(\"ecs_profile.json\");\n";
+            if ((depth == 0u) && inMain && options.pgoInstrument)
+                result += "pgo_dump(\"ecs_pgo.txt\");\n";
+            if ((depth == 0u) && inMain)
+                result += generate_c_program_exit();
             result += "}\n";
+            if (!epilogues.empty()) {
+                result += epilogues.back();
+                epilogues.pop_back();
+            }
+            if (depth == 0u)
+                inFunction = false;
         } else if (inFunction) {
             if (definition.type == DEFINITION_TYPE_CREATE) {
                 result += generate_c_create_ent_with_name(definition.opcode.at(0));
-            } else if (definition.type == DEFINITION_TYPE_FOREACH_CYCLE) {
-                result += generate_c_foreach(definition, definitions);
+            } else if ((definition.type == DEFINITION_TYPE_FOREACH_CYCLE) || (definition.type == DEFINITION_TYPE_FOREACH_HIERARCHY) || (definition.type == DEFINITION_TYPE_FOREACH_EVENT)) {
+                string cycle;
+                if (definition.type == DEFINITION_TYPE_FOREACH_CYCLE)
+                    cycle = generate_c_foreach(definition, definitions, options, bodyPrologue);
+                else if (definition.type == DEFINITION_TYPE_FOREACH_HIERARCHY)
+                    cycle = generate_c_foreach_hierarchy(definition, definitions, options, bodyPrologue);
+                else
+                    cycle = generate_c_foreach_event(definition, options, bodyPrologue, bodyEpilogue);
+
+                if (options.pgoInstrument && is_query(definition)) {
+                    // matches are counted locally and added once the loop is done
+                    const string counter = definition.opcode.at(0) + "__matched";
+                    bodyPrologue += "++" + counter + ";\n";
+                    bodyEpilogue +=
+                    "atomic_fetch_add_explicit(&pgoQueryMatches[" + to_string(query_index(definitions, definition)) + "], " + counter + ", memory_order_relaxed);\n"
+                    "}\n";
+                    cycle = "{\nuint64_t " + counter + " = 0u;\n" + cycle;
+                }
+                if (options.profile) {
+                    string scopeName = definition_type_to_keyword(definition.type);
+                    for (const auto& opcode : definition.opcode)
+                        scopeName += " " + opcode;
+                    cycle = generate_c_profile_begin(scopeName, bodyEpilogue) + cycle;
+                }
+                result += cycle;
+            } else if (definition.type == DEFINITION_TYPE_BINDING) {
+                // already declared by the prologue of its foreach
+            } else if (definition.type == DEFINITION_TYPE_SET_PARENT) {
+                result += generate_c_set_parent(definition);
             } else if (definition.type == DEFINITION_TYPE_ADD_COMPONENTS) {
                 result += generate_c_add_coponents(definition, definitions);
             } else if (definition.type == DEFINITION_TYPE_DESTROY_ENTITY) {
                 result += generate_c_destroy_entity(definition.opcode.at(0));
+            } else if (definition.type == DEFINITION_TYPE_DESTROY_ALL) {
+                result += generate_c_destroy_all(definition, definitions);
             } else {
                 inFunction = false;
             }
         }
         else {
             if (definition.type == DEFINITION_TYPE_FUNCTION) {
-                result += definition.opcode.at(0) + " " + definition.opcode.at(1) + "() ";
+                // main owns its world, every other function works on the world of the caller
+                functionName = definition.opcode.at(1);
+                inMain = (functionName == "main");
+                result += definition.opcode.at(0) + " " + definition.opcode.at(1) + (inMain ? string("() ") : string("(world* __world__) "));
                 if ((i == (definitions.size() - 1)) || (definitions[i + 1].type != DEFINITION_TYPE_BODY_BEGIN)) {
                     result += ";\n";
                 } else {
@@ -538,7 +2268,693 @@ string generate_c_functions(const vector<definition_info>& definitions) {
     return result;
 }
 
-int main() {
+// foreach patterns of the schema, every component alone and every entity. A pattern is its foreach followed by its bindings,
+// every required data component is bound. Bindings are renamed b0, b1... so they never hide the locals of the benchmark
+vector<vector<definition_info>> collect_bench_patterns(const vector<definition_info>& definitions) {
+    vector<vector<definition_info>> patterns;
+    const auto addPattern = [&definitions, &patterns](definition_type type, const vector<string>& components, const vector<definition_info>& bindings) {
+        vector<definition_info> pattern{ definition_info{.type = type, .opcode = { "e" }} };
+        pattern[0].opcode.insert(pattern[0].opcode.end(), components.begin(), components.end());
+        for (const auto& binding : bindings) {
+            pattern.emplace_back(binding);
+            pattern.back().opcode.at(1) = "b" + to_string(pattern.size() - 2u);
+        }
+        for (const auto& component : components) {
+            const definition_info* d = find_component(definitions, component);
+            const bool bound = std::any_of(pattern.begin() + 1, pattern.end(), [&component](const definition_info& binding) {
+                return binding.opcode.at(0) == component;
+            });
+            if ((d != nullptr) && (d->type == DEFINITION_TYPE_COMPONENT) && !bound)
+                pattern.emplace_back(definition_info{.type = DEFINITION_TYPE_BINDING, .opcode = { component, "b" + to_string(pattern.size() - 1u) }});
+        }
+        const bool known = std::any_of(patterns.begin(), patterns.end(), [&pattern](const vector<definition_info>& p) {
+            return (p.size() == pattern.size()) && std::equal(p.begin(), p.end(), pattern.begin(), [](const definition_info& a, const definition_info& b) {
+                return (a.type == b.type) && (a.opcode == b.opcode);
+            });
+        });
+        if (!known)
+            patterns.emplace_back(pattern);
+    };
+    addPattern(DEFINITION_TYPE_FOREACH_CYCLE, {}, {});
+    for (const auto& d : definitions) {
+        if ((d.type == DEFINITION_TYPE_COMPONENT) || (d.type == DEFINITION_TYPE_TAG_COMPONENT))
+            addPattern(DEFINITION_TYPE_FOREACH_CYCLE, { d.opcode.at(0) }, {});
+    }
+    for (const auto& d : definitions) {
+        if (is_query(d))
+            addPattern(d.type, vector<string>(d.opcode.begin() + 1, d.opcode.end()), bindings_of(definitions, d));
+    }
+    return patterns;
+}
+
+// random bytes for every indexed member of the component, through its setter
+string generate_c_bench_keys(const vector<definition_info>& definitions, const definition_info& component) {
+    string result;
+    for (const auto& member : members_of(definitions, component)) {
+        if (!is_indexed_member(member))
+            continue;
+        result +=
+        "{\n"
+        "\t" + member.opcode.at(0) + " key;\n"
+        "\tbench_random_bytes(&key, sizeof(key));\n"
+        "\tset_" + component.opcode.at(0) + "_" + member.opcode.at(1) + "(__world__, entities[i], key);\n"
+        "}\n";
+    }
+    return result;
+}
+
+string generate_c_bench(const vector<definition_info>& definitions, const generator_options& options) {
+    string addSector;
+    string spawnSector;
+    for (const auto& d : definitions) {
+        if ((d.type != DEFINITION_TYPE_COMPONENT) && (d.type != DEFINITION_TYPE_TAG_COMPONENT))
+            continue;
+        const auto& name = d.opcode.at(0);
+        const string keysSector = generate_c_bench_keys(definitions, d);
+        addSector +=
+        "\tcount = 0u;\n"
+        "\tbegin = bench_now();\n"
+        "\tfor (size_t i = 0u; i < entityCount; ++i) {\n"
+        "\t\tif (bench_random() & 1u) {\n"
+        "\t\t\tadd_" + name + "(__world__, entities[i]);\n"
+        + indent_lines(keysSector, "\t\t\t") +
+        "\t\t\t++count;\n"
+        "\t\t}\n"
+        "\t}\n"
+        "\tbench_report(\"add_" + name + "\", bench_now() - begin, count, 0u);\n";
+        spawnSector +=
+        "\t\t\tif (bench_random() & 1u) {\n"
+        "\t\t\t\tadd_" + name + "(__world__, entities[i]);\n"
+        + indent_lines(keysSector, "\t\t\t\t") +
+        "\t\t\t}\n";
+    }
+
+    // the hierarchy sweeps need parents, a quarter of the entities gets one created before it
+    const bool hierarchy = std::any_of(definitions.begin(), definitions.end(), [](const definition_info& d) {
+        return d.type == DEFINITION_TYPE_FOREACH_HIERARCHY;
+    });
+    const string parentsSector = !hierarchy ? string() : string(
+    "\tcount = 0u;\n"
+    "\tbegin = bench_now();\n"
+    "\tfor (size_t i = 1u; i < entityCount; ++i) {\n"
+    "\t\tif ((bench_random() & 3u) == 0u) {\n"
+    "\t\t\tset_parent(__world__, entities[i], entities[bench_random() % i]);\n"
+    "\t\t\t++count;\n"
+    "\t\t}\n"
+    "\t}\n"
+    "\tbench_report(\"set_parent\", bench_now() - begin, count, 0u);\n");
+
+    // every pattern goes through the lowering of the schema functions, group loops and hierarchy sweeps included.
+    // The patterns are appended to a copy of the definitions, the lowering finds the bindings right after their foreach
+    const vector<vector<definition_info>> patterns = collect_bench_patterns(definitions);
+    vector<definition_info> benchDefinitions = definitions;
+    vector<size_t> patternIndexes;
+    for (const auto& pattern : patterns) {
+        patternIndexes.emplace_back(benchDefinitions.size());
+        benchDefinitions.insert(benchDefinitions.end(), pattern.begin(), pattern.end());
+    }
+    string foreachSector;
+    for (const size_t patternIndex : patternIndexes) {
+        const definition_info& pattern = benchDefinitions[patternIndex];
+        string patternName = definition_type_to_keyword(pattern.type);
+        for (size_t ci = 1; ci < pattern.opcode.size(); ++ci)
+            patternName += " " + pattern.opcode[ci];
+        string touchSector;
+        string bytesSector = "0u";
+        for (const auto& binding : bindings_of(benchDefinitions, pattern)) {
+            const auto& name = binding.opcode.at(1);
+            if (is_optional_binding(binding)) {
+                touchSector +=
+                "if (" + name + " != 0)\n"
+                "\tsink += *(const unsigned char*)" + name + ";\n";
+            } else {
+                touchSector += "sink += *(const unsigned char*)" + name + ";\n";
+                bytesSector += " + sizeof(" + binding.opcode.at(0) + ")";
+            }
+        }
+        string bodyPrologue;
+        const string cycle = (pattern.type == DEFINITION_TYPE_FOREACH_HIERARCHY)
+            ? generate_c_foreach_hierarchy(pattern, benchDefinitions, options, bodyPrologue)
+            : generate_c_foreach(pattern, benchDefinitions, options, bodyPrologue);
+        foreachSector +=
+        "\tcount = 0u;\n"
+        "\tbegin = bench_now();\n"
+        "\tfor (size_t round = 0u; round < roundCount; ++round) {\n"
+        "\t\tworld* const __world__ = benchWorld;\n"
+        + indent_lines(
+        cycle + "{\n"
+        + bodyPrologue +
+        "++count;\n"
+        + touchSector +
+        "}\n", "\t\t") +
+        "\t}\n"
+        "\tbench_report(\"" + patternName + "\", bench_now() - begin, count, count * (" + bytesSector + "));\n"
+        "\tsink += count;\n";
+    }
+
+    return
+    "#include <stdio.h>\n"
+    "#include <stdlib.h>\n"
+    "#include <time.h>\n"
+    "#include <sys/resource.h>\n"
+    "\n"
+    "static uint64_t benchRandomState = 88172645463325252u;\n"
+    "static volatile unsigned long long sink = 0u;\n"
+    "static world* volatile benchWorld = 0; // reloaded every round, keeps the compiler from hoisting the loops\n"
+    "\n"
+    "static uint64_t bench_now() {\n"
+    "\tstruct timespec ts;\n"
+    "\tclock_gettime(CLOCK_MONOTONIC, &ts);\n"
+    "\treturn (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;\n"
+    "}\n"
+    "\n"
+    "static uint64_t bench_random() {\n"
+    "\tbenchRandomState ^= benchRandomState << 13;\n"
+    "\tbenchRandomState ^= benchRandomState >> 7;\n"
+    "\tbenchRandomState ^= benchRandomState << 17;\n"
+    "\treturn benchRandomState;\n"
+    "}\n"
+    "\n"
+    + (!has_indexed_members(definitions) ? string() : string(
+    "static void bench_random_bytes(void* value, size_t size) {\n"
+    "\tfor (size_t i = 0u; i < size; ++i)\n"
+    "\t\t((unsigned char*)value)[i] = (unsigned char)bench_random();\n"
+    "}\n"
+    "\n")) +
+    "// count is the number of entities the operation touched, bytes the component data it read\n"
+    "static void bench_report(const char* operation, uint64_t ns, size_t count, size_t bytes) {\n"
+    "\tstruct rusage usage;\n"
+    "\tgetrusage(RUSAGE_SELF, &usage);\n"
+    "\tconst double seconds = (double)ns / 1e9;\n"
+    "\tprintf(\"%-48s %10.2f ns/entity %10.2f Mentity/s %10.2f MB/s %10ld KB peak rss\\n\",\n"
+    "\t\toperation,\n"
+    "\t\tcount ? (double)ns / (double)count : 0.0,\n"
+    "\t\t(seconds > 0.0) ? (double)count / seconds / 1e6 : 0.0,\n"
+    "\t\t(seconds > 0.0) ? (double)bytes / seconds / 1e6 : 0.0,\n"
+    "\t\tusage.ru_maxrss);\n"
+    "}\n"
+    "\n"
+    "// ecs_bench [entity count] [rounds]\n"
+    "int main(int argc, char** argv) {\n"
+    "\tsize_t entityCount = (argc > 1) ? (size_t)strtoull(argv[1], 0, 10) : MAX_ENTITY_COUNT;\n"
+    "\tconst size_t roundCount = (argc > 2) ? (size_t)strtoull(argv[2], 0, 10) : 10u;\n"
+    "\tif ((entityCount == 0u) || (entityCount > MAX_ENTITY_COUNT))\n"
+    "\t\tentityCount = MAX_ENTITY_COUNT;\n"
+    "\tworld* __world__ = world_create();\n"
+    "\tentity_t* entities = (entity_t*)malloc(entityCount * sizeof(entity_t));\n"
+    "\tif ((__world__ == 0) || (entities == 0))\n"
+    "\t\treturn 1;\n"
+    "\tbenchWorld = __world__;\n"
+    "\tsize_t count = 0u;\n"
+    "\tuint64_t begin = bench_now();\n"
+    "\tfor (size_t i = 0u; i < entityCount; ++i)\n"
+    "\t\tentities[i] = create(__world__);\n"
+    "\tbench_report(\"create\", bench_now() - begin, entityCount, 0u);\n"
+    + addSector
+    + parentsSector
+    + foreachSector +
+    "\tfor (size_t round = 0u; round < roundCount; ++round) {\n"
+    "\t\tcount = 0u;\n"
+    "\t\tbegin = bench_now();\n"
+    "\t\tfor (size_t i = 0u; i < entityCount; ++i) {\n"
+    "\t\t\tif (bench_random() & 1u) {\n"
+    "\t\t\t\tdestroy_entity(__world__, entities[i]);\n"
+    "\t\t\t\tentities[i] = NO_ENTITY;\n"
+    "\t\t\t\t++count;\n"
+    "\t\t\t}\n"
+    "\t\t}\n"
+    "\t\tif (round == 0u)\n"
+    "\t\t\tbench_report(\"churn destroy_entity\", bench_now() - begin, count, 0u);\n"
+    "\t\tbegin = bench_now();\n"
+    "\t\tfor (size_t i = 0u; i < entityCount; ++i) {\n"
+    "\t\t\tif (entities[i] != NO_ENTITY)\n"
+    "\t\t\t\tcontinue;\n"
+    "\t\t\tentities[i] = create(__world__);\n"
+    + spawnSector +
+    "\t\t}\n"
+    "\t\tif (round == 0u)\n"
+    "\t\t\tbench_report(\"churn create with random components\", bench_now() - begin, count, 0u);\n"
+    "\t}\n"
+    "\tprintf(\"checksum %llu\\n\", sink);\n"
+    "\tfree(entities);\n"
+    "\tworld_destroy(__world__);\n"
+    "\treturn 0;\n"
+    "}\n";
+}
+
+string generate_cmake_bench() {
+    return
+    "cmake_minimum_required(VERSION 3.10)\n"
+    "project(ecs_bench C)\n"
+    "set(CMAKE_C_STANDARD 11)\n"
+    "if(NOT CMAKE_BUILD_TYPE)\n"
+    "set(CMAKE_BUILD_TYPE Release)\n"
+    "endif()\n"
+    "set(ECS_BENCH_MAX_ENTITIES 65536 CACHE STRING \"MAX_ENTITY_COUNT of the benchmarked world\")\n"
+    "add_executable(ecs_bench ecs_bench.c)\n"
+    "target_compile_definitions(ecs_bench PRIVATE MAX_ENTITY_COUNT=${ECS_BENCH_MAX_ENTITIES})\n";
+}
+
+bool write_file(const string& path, const string& content) {
+    std::ofstream file(path, std::ios::binary);
+    file << content;
+    return static_cast<bool>(file);
+}
+
+// writes next to path and renames, a reader never sees a half written file
+bool replace_file(const string& path, const string& content) {
+    const string temporary = path + ".tmp";
+    return write_file(temporary, content) && (std::rename(temporary.c_str(), path.c_str()) == 0);
+}
+
+// small accessors the compiler should be able to inline into every translation unit
+bool is_inline_accessor(const string& name) {
+    const auto startsWith = [&name](const string& prefix) { return name.compare(0u, prefix.size(), prefix) == 0; };
+    const string destroySuffix = "_destroy";
+    const bool structDestructor = (name.size() > destroySuffix.size()) && (name.compare(name.size() - destroySuffix.size(), destroySuffix.size(), destroySuffix) == 0) && !startsWith("world_");
+    return startsWith("get_") || startsWith("has_") || startsWith("view_") || startsWith("snapshot_") || structDestructor;
+}
+
+// header: macros, types, static inline accessors and prototypes of everything else.
+// source: the definitions, static tables, profiler state and the schema functions, it includes the header.
+// Works on the generated runtime text: top-level items start in column 0 and end with a `}` line
+void split_generated_code(const string& code, const string& functions, const string& functionPrototypes, const string& headerName, string& header, string& source) {
+    vector<string> lines;
+    for (size_t begin = 0u; begin < code.size(); ) {
+        const size_t end = code.find('\n', begin);
+        lines.emplace_back(code.substr(begin, (end == string::npos) ? string::npos : end - begin));
+        begin = (end == string::npos) ? code.size() : end + 1u;
+    }
+    const auto startsWith = [](const string& line, const string& prefix) { return line.compare(0u, prefix.size(), prefix) == 0; };
+
+    string guard = "ECS_GEN_";
+    for (const char c : headerName.substr(headerName.find_last_of('/') + 1u))
+        guard += std::isalnum(static_cast<unsigned char>(c)) ? static_cast<char>(std::toupper(static_cast<unsigned char>(c))) : '_';
+    header = "#ifndef " + guard + "\n#define " + guard + "\n";
+    source = "#include \"" + headerName.substr(headerName.find_last_of('/') + 1u) + "\"\n";
+    string prototypes;
+    string leading; // comments and blank lines, they stay with the item below them
+    for (size_t i = 0u; i < lines.size(); ++i) {
+        const string& line = lines[i];
+        if (line.empty() || startsWith(line, "//")) {
+            leading += line + "\n";
+            continue;
+        }
+        string item = line + "\n";
+        if (startsWith(line, "#if")) {
+            for (size_t depth = 1u; (depth != 0u) && (i + 1u < lines.size()); ) {
+                const string& next = lines[++i];
+                depth += startsWith(next, "#if") ? 1u : (startsWith(next, "#endif") ? static_cast<size_t>(-1) : 0u);
+                item += next + "\n";
+            }
+            header += leading + item;
+        } else if ((line.back() == '{') && !startsWith(line, "#")) {
+            while ((i + 1u < lines.size()) && (lines[i] != "}") && !startsWith(lines[i], "} ") && (lines[i] != "};"))
+                item += lines[++i] + "\n";
+            const size_t paren = line.find('(');
+            size_t nameBegin = (paren == string::npos) ? 0u : paren;
+            while ((nameBegin > 0u) && (std::isalnum(static_cast<unsigned char>(line[nameBegin - 1u])) || (line[nameBegin - 1u] == '_')))
+                --nameBegin;
+            const string name = line.substr(nameBegin, paren - nameBegin);
+            if (startsWith(line, "typedef")) {
+                header += leading + item;
+            } else if (startsWith(line, "static")) {
+                source += leading + item;
+            } else if (is_inline_accessor(name)) {
+                header += leading + "static inline " + item;
+            } else {
+                source += leading + item;
+                if (name != "main")
+                    prototypes += line.substr(0u, line.size() - 2u) + ";\n";
+            }
+        } else if (startsWith(line, "#") || startsWith(line, "typedef") || startsWith(line, "extern")) {
+            header += leading + item;
+        } else {
+            source += leading + item;
+        }
+        leading.clear();
+    }
+    header += "\n" + prototypes + functionPrototypes + "#endif\n";
+    source += leading + functions;
+}
+
+// declarations of the functions of the schema, main excluded
+string generate_c_function_prototypes(const vector<definition_info>& definitions) {
+    string result;
+    for (const auto& d : definitions) {
+        if ((d.type == DEFINITION_TYPE_FUNCTION) && (d.opcode.at(1) != "main") && (result.find(" " + d.opcode.at(1) + "(") == string::npos))
+            result += d.opcode.at(0) + " " + d.opcode.at(1) + "(world* __world__);\n";
+    }
+    return result;
+}
+
+string generate_c_runtime(const vector<definition_info>& definitions, const generator_options& options) {
+    return
+    generate_c_start_code(definitions, options) +
+    generate_c_profiler(options) +
+    generate_c_pgo(definitions, options) +
+    generate_c_structures(definitions) +
+    generate_c_world(definitions, options) +
+    generate_c_after_components_definition(definitions, options);
+}
+
+// the files named by --header and --source, by -o, or stdout
+string output_name(const generator_options& options) {
+    if (!options.headerPath.empty())
+        return options.headerPath + " and " + options.sourcePath;
+    return options.outputPath.empty() ? string("stdout") : options.outputPath;
+}
+
+bool write_generated_code(const vector<definition_info>& definitions, const generator_options& options) {
+    const string runtime = generate_c_runtime(definitions, options);
+    const string functions = generate_c_functions(definitions, options);
+    if (!options.headerPath.empty()) {
+        string header;
+        string source;
+        split_generated_code(runtime, functions, generate_c_function_prototypes(definitions), options.headerPath, header, source);
+        return replace_file(options.headerPath, header) && replace_file(options.sourcePath, source);
+    }
+    if (!options.outputPath.empty())
+        return replace_file(options.outputPath, runtime + functions);
+    cout << runtime << functions;
+    return true;
+}
+
+// one top-level definition of a schema: a struct, component, event, group or function
+struct schema_chunk {
+    string text;
+    size_t line; // newlines before the chunk
+    size_t column; // characters between the last of them and the chunk
+    bool function;
+};
+
+// splits on `;` and on the `}` that closes a function body, both at brace depth 0
+vector<schema_chunk> split_schema(const string& data) {
+    vector<schema_chunk> chunks;
+    size_t begin = 0u;
+    size_t line = 0u;
+    size_t lineStart = 0u;
+    size_t beginLine = 0u;
+    size_t beginColumn = 0u;
+    size_t depth = 0u;
+    for (size_t i = 0u; i < data.size(); ++i) {
+        const char c = data[i];
+        bool end = false;
+        if (c == '\n') {
+            ++line;
+            lineStart = i + 1u;
+        } else if (c == '{') {
+            ++depth;
+        } else if ((c == '}') && (depth > 0u)) {
+            --depth;
+            const size_t next = data.find_first_not_of(" \t\r\n", i + 1u);
+            end = (depth == 0u) && ((next == string::npos) || (data[next] != ';'));
+        } else if ((c == ';') && (depth == 0u)) {
+            end = true;
+        }
+        if (end) {
+            const string text = data.substr(begin, i + 1u - begin);
+            const size_t first = text.find_first_not_of(" \t\r\n");
+            chunks.emplace_back(schema_chunk{text, beginLine, beginColumn, (first != string::npos) && (text[first] == '~')});
+            begin = i + 1u;
+            beginLine = line;
+            beginColumn = begin - lineStart;
+        }
+    }
+    if (data.find_first_not_of(" \t\r\n", begin) != string::npos)
+        chunks.emplace_back(schema_chunk{data.substr(begin), beginLine, beginColumn, false});
+    return chunks;
+}
+
+// chunks are parsed on their own, so component and tag ids are given again in schema order
+void renumber_components(vector<definition_info>& definitions) {
+    size_t componentCount = 0u;
+    size_t tagCount = 0u;
+    for (auto& d : definitions) {
+        if (d.type == DEFINITION_TYPE_COMPONENT)
+            d.opcode.at(1) = to_string(componentCount++);
+        else if (d.type == DEFINITION_TYPE_TAG_COMPONENT)
+            d.opcode.at(1) = to_string(tagCount++);
+    }
+}
+
+// parsed definitions of every chunk of the last good schema, keyed by the chunk text.
+// Functions depend only on the declarations, so while those are unchanged an edited
+// function is the only chunk parsed again. Any other edit parses the whole schema.
+struct schema_cache {
+    vector<string> declarations;
+    std::map<string, vector<definition_info>> chunks;
+};
+
+vector<definition_info> parse_schema(const string& data, schema_cache& cache, size_t& parsedChunks) {
+    const vector<schema_chunk> chunks = split_schema(data);
+    vector<string> declarations;
+    for (const auto& chunk : chunks) {
+        if (!chunk.function)
+            declarations.emplace_back(chunk.text);
+    }
+    if (declarations != cache.declarations)
+        cache.chunks.clear();
+
+    std::map<string, vector<definition_info>> parsed;
+    vector<definition_info> definitions;
+    parsedChunks = 0u;
+    for (const auto& chunk : chunks) {
+        auto cached = cache.chunks.find(chunk.text);
+        if (cached == cache.chunks.end()) {
+            // declarations above the chunk are visible to it, its own definitions are appended
+            const size_t first = definitions.size();
+            errorLineOffset = chunk.line;
+            parse_definitions(string(chunk.column, ' ') + chunk.text, definitions);
+            errorLineOffset = 0u;
+            definitions.pop_back(); // the schema gets a single eof
+            cached = parsed.emplace(chunk.text, vector<definition_info>(definitions.begin() + first, definitions.end())).first;
+            ++parsedChunks;
+        } else {
+            definitions.insert(definitions.end(), cached->second.begin(), cached->second.end());
+            parsed.insert(*cached);
+        }
+    }
+    definitions.emplace_back(definition_info{.type = DEFINITION_TYPE_EOF, .opcode = {}});
+    renumber_components(definitions);
+    cache.declarations = declarations;
+    cache.chunks = parsed;
+    return definitions;
+}
+
+bool read_file(const string& path, string& content) {
+    std::ifstream file(path, std::ios::binary);
+    if (!file)
+        return false;
+    std::stringstream stream;
+    stream << file.rdbuf();
+    content = stream.str();
+    return true;
+}
+
+// index right after the members of a definition
+size_t definition_end(const vector<definition_info>& definitions, const definition_info& definition) {
+    return static_cast<size_t>(&definition - definitions.data()) + 1u + members_of(definitions, definition).size();
+}
+
+// --pgo-use: the weight of a component is its reads plus the matches of the foreach loops that require it,
+// the weight of a pair the matches of the loops that require both. Names the schema no longer has are skipped
+void apply_pgo_profile(const string& path, vector<definition_info>& definitions) {
+    string data;
+    if (!read_file(path, data)) {
+        cout << "can't open " + path + "\n";
+        fail();
+    }
+    std::map<string, uint64_t> weights;
+    std::map<std::pair<string, string>, uint64_t> pairWeights;
+    std::istringstream lines(data);
+    size_t lineNumber = 0u;
+    for (string line; std::getline(lines, line); ) {
+        ++lineNumber;
+        std::istringstream fields(line);
+        string kind;
+        unsigned long long count = 0u;
+        if (!(fields >> kind))
+            continue;
+        if (kind == "component") {
+            string name;
+            if (fields >> name >> count) {
+                weights[name] += count;
+                continue;
+            }
+        } else if (kind == "query") {
+            if (fields >> count) {
+                for (string name; fields >> name; )
+                    weights[name] += count;
+                continue;
+            }
+        } else if (kind == "pair") {
+            string first;
+            string second;
+            if (fields >> first >> second >> count) {
+                pairWeights[std::make_pair(std::min(first, second), std::max(first, second))] += count;
+                continue;
+            }
+        }
+        cout << path + ":" + to_string(lineNumber) + ": invalid profile line\n";
+        fail();
+    }
+
+    // the pairs joined most often get a group, heaviest first, a component joins one group at most
+    vector<std::pair<uint64_t, std::pair<string, string>>> pairs;
+    for (const auto& pair : pairWeights) {
+        if (pair.second != 0u)
+            pairs.emplace_back(pair.second, pair.first);
+    }
+    std::stable_sort(pairs.begin(), pairs.end(), [](const std::pair<uint64_t, std::pair<string, string>>& a, const std::pair<uint64_t, std::pair<string, string>>& b) {
+        return a.first > b.first;
+    });
+    for (const auto& pair : pairs) {
+        const definition_info* first = find_component(definitions, pair.second.first);
+        const definition_info* second = find_component(definitions, pair.second.second);
+        if ((first == nullptr) || (second == nullptr) || (first->type != DEFINITION_TYPE_COMPONENT) || (second->type != DEFINITION_TYPE_COMPONENT) ||
+            (find_owning_group(definitions, first->opcode.at(0)) != nullptr) || (find_owning_group(definitions, second->opcode.at(0)) != nullptr))
+            continue;
+        // after both components, the group struct uses their types
+        const size_t position = std::max(definition_end(definitions, *first), definition_end(definitions, *second));
+        definitions.insert(definitions.begin() + position, definition_info{.type = DEFINITION_TYPE_GROUP, .opcode = { pair.second.first, pair.second.second }});
+    }
+
+    // the hottest components get the lowest ids: the first componentMask word and the first bits destroy_entity visits
+    vector<definition_info*> components;
+    for (auto& d : definitions) {
+        if (d.type == DEFINITION_TYPE_COMPONENT)
+            components.emplace_back(&d);
+    }
+    std::stable_sort(components.begin(), components.end(), [&weights](const definition_info* a, const definition_info* b) {
+        return weights[a->opcode.at(0)] > weights[b->opcode.at(0)];
+    });
+    for (size_t i = 0u; i < components.size(); ++i)
+        components[i]->opcode.at(1) = to_string(i);
+}
+
+// keeps the parsed schema in memory and rewrites the output after every save.
+// A broken schema is reported and the last good output stays in place
+int watch_schema(const string& schemaPath, const generator_options& options) {
+#ifdef __linux__
+    const size_t slash = schemaPath.find_last_of('/');
+    const string directory = (slash == string::npos) ? string(".") : schemaPath.substr(0u, slash + 1u);
+    const string fileName = (slash == string::npos) ? schemaPath : schemaPath.substr(slash + 1u);
+
+    // editors often save by renaming a new file over the old one, so the directory is watched
+    const int notify = inotify_init();
+    if ((notify < 0) || (inotify_add_watch(notify, directory.c_str(), IN_CLOSE_WRITE | IN_MOVED_TO | IN_CREATE) < 0)) {
+        cout << "can't watch " + directory + "\n";
+        return 1;
+    }
+
+    recoverableErrors = true;
+    schema_cache cache;
+    for (bool changed = true; ; ) {
+        string data;
+        if (changed && read_file(schemaPath, data)) {
+            const auto begin = std::chrono::steady_clock::now();
+            try {
+                size_t parsedChunks = 0u;
+                vector<definition_info> definitions = parse_schema(data, cache, parsedChunks);
+                if (!options.pgoProfilePath.empty())
+                    apply_pgo_profile(options.pgoProfilePath, definitions);
+                if (!write_generated_code(definitions, options))
+                    cout << "can't write " + output_name(options) + "\n";
+                const auto time = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - begin);
+                cout << output_name(options) + " regenerated in " + to_string(time.count() / 1000.0) + " ms, " + to_string(parsedChunks) + " chunks parsed\n";
+            } catch (const schema_error&) {
+                errorLineOffset = 0u;
+                cout << schemaPath + " has errors, " + output_name(options) + " is unchanged\n";
+            }
+            cout.flush();
+        }
+
+        // one read returns every event of a save, they trigger a single regeneration
+        alignas(inotify_event) char events[4096];
+        const ssize_t size = read(notify, events, sizeof(events));
+        if (size <= 0)
+            break;
+        changed = false;
+        for (ssize_t offset = 0; offset < size; ) {
+            const inotify_event* event = reinterpret_cast<const inotify_event*>(events + offset);
+            if ((event->len != 0u) && (fileName == event->name))
+                changed = true;
+            offset += static_cast<ssize_t>(sizeof(inotify_event) + event->len);
+        }
+    }
+    close(notify);
+    return 1;
+#else
+    (void)schemaPath;
+    (void)options;
+    cout << "--watch needs inotify, it is only available on linux\n";
+    return 1;
+#endif
+}
+
+void print_usage() {
+    cout <<
+    "usage: ecs_gen [options] [schema]\n"
+    "  --profile      instrument generated functions and foreach blocks, see profiler_dump()\n"
+    "  --bench <dir>  write ecs_bench.c and its CMakeLists.txt for the schema to <dir>\n"
+    "  -o <file>      write the generated code to <file> instead of stdout\n"
+    "  --watch        keep running and regenerate the output every time the schema is saved\n"
+    "  --shm          keep all world storage inline and generate world_create_shared() and the world_attach() observer API\n"
+    "  --header <h> --source <c>\n"
+    "                 write a header with static inline accessors and prototypes, and a source file with the rest\n"
+    "  --hints        mark the accessors hot and their presence checks unlikely to fail\n"
+    "  --pgo-instrument\n"
+    "                 count component reads and foreach matches, see pgo_dump()\n"
+    "  --pgo-use <profile>\n"
+    "                 order component ids and group components by a profile written by pgo_dump()\n";
+}
+
+int main(int argc, char** argv) {
+    generator_options options = {};
+    string schemaPath;
+    for (int i = 1; i < argc; ++i) {
+        const string argument = argv[i];
+        if (argument == "--profile") {
+            options.profile = true;
+        } else if ((argument == "--bench") && (i + 1 < argc)) {
+            options.benchDirectory = argv[++i];
+        } else if ((argument == "-o") && (i + 1 < argc)) {
+            options.outputPath = argv[++i];
+        } else if (argument == "--watch") {
+            options.watch = true;
+        } else if (argument == "--shm") {
+            options.shm = true;
+        } else if ((argument == "--header") && (i + 1 < argc)) {
+            options.headerPath = argv[++i];
+        } else if ((argument == "--source") && (i + 1 < argc)) {
+            options.sourcePath = argv[++i];
+        } else if (argument == "--hints") {
+            options.hints = true;
+        } else if (argument == "--pgo-instrument") {
+            options.pgoInstrument = true;
+        } else if ((argument == "--pgo-use") && (i + 1 < argc)) {
+            options.pgoProfilePath = argv[++i];
+        } else if ((argument[0] != '-') && schemaPath.empty()) {
+            schemaPath = argument;
+        } else {
+            print_usage();
+            return 1;
+        }
+    }
+    if (options.headerPath.empty() != options.sourcePath.empty()) {
+        print_usage();
+        return 1;
+    }
+    if (options.watch) {
+        if (schemaPath.empty() || (options.outputPath.empty() && options.headerPath.empty()) || !options.benchDirectory.empty()) {
+            print_usage();
+            return 1;
+        }
+        return watch_schema(schemaPath, options);
+    }
+
+    // without a schema file the built-in example is generated
     string data =
     "struct point {\n"
     "\tfloat x;\n"
@@ -559,16 +2975,16 @@ int main() {
     "\nforeach entity position { entity.destroy(); }\n"
     "}\n";
 
-    sxt::tokenizer<string> tokenizer(data.begin(), data.end());
-    vector<sxt::value_token<string>> tokens;
-    for (sxt::value_token<string> current = tokenizer.next_new_token(sxt::STX_EXT_TOKEN_TYPE_FLAG_BIT_NONE); current.is_valid(); current = tokenizer.next_new_token(sxt::STX_EXT_TOKEN_TYPE_FLAG_BIT_NONE)) {
-        tokens.emplace_back(current);
+    if (!schemaPath.empty() && !read_file(schemaPath, data)) {
+        cout << "can't open " + schemaPath + "\n";
+        return 1;
     }
 
     vector<definition_info> definitions;
-    size_t componentCount = 0u;
 
     parse_definitions(data, definitions);
+    if (!options.pgoProfilePath.empty())
+        apply_pgo_profile(options.pgoProfilePath, definitions);
     // print "IR"
     // for (const auto& i : definitions) {
     //     cout << definition_type_to_string(i.type) << ' ';
@@ -577,10 +2993,19 @@ int main() {
     //     }
     //     cout << ";\n";
     // }
-    cout << generate_c_start_code(definitions);
-    cout << generate_c_structures(definitions);
-    cout << generate_c_after_components_definition(definitions);
-    cout << generate_c_functions(definitions);
+    if (!options.benchDirectory.empty()) {
+        // the benchmark replaces the functions of the schema, it has its own main
+        if (!write_file(options.benchDirectory + "/ecs_bench.c", generate_c_runtime(definitions, options) + generate_c_bench(definitions, options)) ||
+            !write_file(options.benchDirectory + "/CMakeLists.txt", generate_cmake_bench())) {
+            cout << "can't write the benchmark to " + options.benchDirectory + "\n";
+            return 1;
+        }
+        return 0;
+    }
 
+    if (!write_generated_code(definitions, options)) {
+        cout << "can't write " + output_name(options) + "\n";
+        return 1;
+    }
     return 0;
 }